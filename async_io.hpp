@@ -0,0 +1,314 @@
+#ifndef _ASYNC_IO_D_H
+#define _ASYNC_IO_D_H
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ORDER_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// <linux/fs.h> leaks BLOCK_SIZE, which the queue headers use as a member name
+#undef BLOCK_SIZE
+#undef BLOCK_SIZE_BITS
+#endif
+#endif
+
+namespace Order {
+
+// Positional reads and writes that complete in the background. read() and
+// write() return a ticket; wait() blocks until that request is done and
+// returns the bytes moved or -errno. Uses an io_uring ring when the kernel
+// provides one, and a helper thread doing pread/pwrite otherwise. One
+// instance serves one thread at a time.
+class AsyncIo {
+public:
+  explicit AsyncIo(unsigned depth = 64) {
+#ifdef ORDER_HAVE_IO_URING
+    if (setup_ring(depth)) {
+      return;
+    }
+#endif
+    (void)depth;
+    helper = std::thread([this]() { serve(); });
+  }
+  ~AsyncIo() {
+#ifdef ORDER_HAVE_IO_URING
+    if (ring_fd >= 0) {
+      while (in_flight > 0) {
+        reap(true);
+      }
+      teardown_ring();
+      return;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_all();
+    helper.join();
+  }
+  AsyncIo(const AsyncIo &) = delete;
+  AsyncIo &operator=(const AsyncIo &) = delete;
+
+  bool uses_uring() const { return ring_fd >= 0; }
+
+  uint64_t read(int fd, void *buf, size_t len, uint64_t offset) {
+    return submit(Request{next_ticket++, false, fd, buf, len, offset});
+  }
+
+  uint64_t write(int fd, const void *buf, size_t len, uint64_t offset) {
+    return submit(Request{next_ticket++, true, fd, const_cast<void *>(buf), len, offset});
+  }
+
+  long long wait(uint64_t ticket) {
+#ifdef ORDER_HAVE_IO_URING
+    if (ring_fd >= 0) {
+      while (true) {
+        long long res;
+        if (take(ticket, res)) {
+          return res;
+        }
+        reap(true);
+      }
+    }
+#endif
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      long long res;
+      if (take(ticket, res)) {
+        return res;
+      }
+      cv.wait(lock);
+    }
+  }
+
+private:
+  struct Request {
+    uint64_t ticket;
+    bool is_write;
+    int fd;
+    void *buf;
+    size_t len;
+    uint64_t offset;
+  };
+
+  // Pop the result for `ticket` if it has completed
+  bool take(uint64_t ticket, long long &res) {
+    for (size_t i = 0; i < done.size(); i++) {
+      if (done[i].first == ticket) {
+        res = done[i].second;
+        done[i] = done.back();
+        done.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  uint64_t submit(const Request &r) {
+#ifdef ORDER_HAVE_IO_URING
+    if (ring_fd >= 0) {
+      // Keep completions from overflowing the CQ ring
+      while (in_flight >= sq_entries) {
+        reap(true);
+      }
+      unsigned tail = *sq_tail;
+      unsigned idx = tail & *sq_mask;
+      io_uring_sqe *sqe = &sqes[idx];
+      std::memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = r.is_write ? IORING_OP_WRITE : IORING_OP_READ;
+      sqe->fd = r.fd;
+      sqe->addr = reinterpret_cast<uint64_t>(r.buf);
+      sqe->len = static_cast<uint32_t>(r.len);
+      sqe->off = r.offset;
+      sqe->user_data = r.ticket;
+      sq_array[idx] = idx;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      in_flight++;
+      unsubmitted++;
+      int err = flush_sq();
+      if (err != 0) {
+        // Nothing queued before this entry is left over, so it is the one
+        // the kernel never took; take it back and fail the request
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        unsubmitted = 0;
+        in_flight--;
+        done.emplace_back(r.ticket, err);
+      }
+      return r.ticket;
+    }
+#endif
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(r);
+    }
+    cv.notify_all();
+    return r.ticket;
+  }
+
+  // Helper thread: run queued requests in order
+  void serve() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+      if (queue.empty()) {
+        return;
+      }
+      Request r = queue.front();
+      queue.pop_front();
+      lock.unlock();
+      ssize_t n = r.is_write ? pwrite(r.fd, r.buf, r.len, r.offset)
+                             : pread(r.fd, r.buf, r.len, r.offset);
+      lock.lock();
+      done.emplace_back(r.ticket, n < 0 ? -errno : n);
+      cv.notify_all();
+    }
+  }
+
+#ifdef ORDER_HAVE_IO_URING
+  // Hand the queued SQEs to the kernel. EINTR is retried, and EAGAIN or
+  // EBUSY after reaping, since they mean the kernel is short of room for
+  // completions. Returns -errno on any other failure.
+  int flush_sq() {
+    while (unsubmitted > 0) {
+      long n = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 0, 0, nullptr, 0);
+      if (n > 0) {
+        unsubmitted -= static_cast<unsigned>(n);
+      } else if (n == 0 || errno == EAGAIN || errno == EBUSY) {
+        if (in_flight > unsubmitted) {
+          reap(true);
+        } else {
+          std::this_thread::yield();
+        }
+      } else if (errno != EINTR) {
+        return -errno;
+      }
+    }
+    return 0;
+  }
+
+  bool setup_ring(unsigned depth) {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &p));
+    if (fd < 0) {
+      return false;
+    }
+    // IORING_OP_READ and IORING_OP_WRITE need a 5.6 kernel
+    std::vector<char> probe_bytes(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe *>(probe_bytes.data());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+        probe->last_op < IORING_OP_WRITE ||
+        !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)) {
+      close(fd);
+      return false;
+    }
+    sq_bytes = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_bytes = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+    }
+    void *sq = mmap(nullptr, sq_bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *cq = single ? sq
+                      : mmap(nullptr, cq_bytes, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *se = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || se == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    sq_ring = static_cast<char *>(sq);
+    cq_ring = static_cast<char *>(cq);
+    sqes = static_cast<io_uring_sqe *>(se);
+    sq_entries = p.sq_entries;
+    sq_tail = reinterpret_cast<unsigned *>(sq_ring + p.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq_ring + p.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq_ring + p.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq_ring + p.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq_ring + p.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq_ring + p.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq_ring + p.cq_off.cqes);
+    ring_fd = fd;
+    return true;
+  }
+
+  void teardown_ring() {
+    munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+    if (cq_ring != sq_ring) {
+      munmap(cq_ring, cq_bytes);
+    }
+    munmap(sq_ring, sq_bytes);
+    close(ring_fd);
+  }
+
+  // Move finished completions into `done`, optionally sleeping for one.
+  // SQEs not yet taken by the kernel are submitted on the way, or the
+  // completion waited for might never come.
+  void reap(bool block) {
+    unsigned head = *cq_head;
+    if (block && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      long n = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, 1,
+                       IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (n > 0) {
+        unsubmitted -= std::min(unsubmitted, static_cast<unsigned>(n));
+      }
+    }
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      const io_uring_cqe &cqe = cqes[head & *cq_mask];
+      done.emplace_back(cqe.user_data, cqe.res);
+      head++;
+      in_flight--;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  char *sq_ring = nullptr;
+  char *cq_ring = nullptr;
+  size_t sq_bytes = 0;
+  size_t cq_bytes = 0;
+  io_uring_sqe *sqes = nullptr;
+  unsigned sq_entries = 0;
+  unsigned *sq_tail = nullptr;
+  unsigned *sq_mask = nullptr;
+  unsigned *sq_array = nullptr;
+  unsigned *cq_head = nullptr;
+  unsigned *cq_tail = nullptr;
+  unsigned *cq_mask = nullptr;
+  io_uring_cqe *cqes = nullptr;
+  unsigned in_flight = 0;
+  // Entries in the SQ ring the kernel hasn't taken yet
+  unsigned unsubmitted = 0;
+#endif
+
+  int ring_fd = -1;
+  uint64_t next_ticket = 1;
+  std::vector<std::pair<uint64_t, long long>> done;
+  // Helper thread fallback
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Request> queue;
+  bool stopping = false;
+  std::thread helper;
+};
+
+} // namespace Order
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef _CODEC_D_H
+#define _CODEC_D_H
+
+#include <cstddef>
+
+// A codec is compiled in when the build defines ORDER_WITH_LZ4 or
+// ORDER_WITH_ZSTD and links the library; CMakeLists.txt does both when it
+// finds them.
+#if defined(ORDER_WITH_LZ4) && defined(__has_include)
+#if __has_include(<lz4.h>)
+#define ORDER_HAVE_LZ4 1
+#include <lz4.h>
+#endif
+#endif
+
+#if defined(ORDER_WITH_ZSTD) && defined(__has_include)
+#if __has_include(<zstd.h>)
+#define ORDER_HAVE_ZSTD 1
+#include <zstd.h>
+#endif
+#endif
+
+namespace Order {
+
+// Block compression for spilled runs. lz4 is fast, zstd packs tighter.
+enum class Codec { none, lz4, zstd };
+
+inline bool codec_available(Codec codec) {
+  switch (codec) {
+  case Codec::none:
+    return true;
+  case Codec::lz4:
+#ifdef ORDER_HAVE_LZ4
+    return true;
+#else
+    return false;
+#endif
+  case Codec::zstd:
+#ifdef ORDER_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+// Compress `n` bytes into `dst`, which holds `cap`. Returns the packed size,
+// or 0 when it would not come out smaller than `cap`. `level` is the lz4
+// acceleration or the zstd level; 0 picks the library default.
+inline size_t encode_block(Codec codec, int level, const void *src, size_t n,
+                           void *dst, size_t cap) {
+  (void)level;
+  (void)src;
+  (void)n;
+  (void)dst;
+  (void)cap;
+  switch (codec) {
+  case Codec::none:
+    return 0;
+  case Codec::lz4: {
+#ifdef ORDER_HAVE_LZ4
+    int got = LZ4_compress_fast(static_cast<const char *>(src), static_cast<char *>(dst),
+                                static_cast<int>(n), static_cast<int>(cap),
+                                level > 0 ? level : 1);
+    return got > 0 && static_cast<size_t>(got) < cap ? got : 0;
+#else
+    return 0;
+#endif
+  }
+  case Codec::zstd: {
+#ifdef ORDER_HAVE_ZSTD
+    size_t got = ZSTD_compress(dst, cap, src, n, level != 0 ? level : ZSTD_CLEVEL_DEFAULT);
+    return !ZSTD_isError(got) && got < cap ? got : 0;
+#else
+    return 0;
+#endif
+  }
+  }
+  return 0;
+}
+
+// Undo encode_block. `raw` is the exact unpacked size; false on corrupt
+// input or a codec that is not compiled in.
+inline bool decode_block(Codec codec, const void *src, size_t n, void *dst,
+                         size_t raw) {
+  (void)src;
+  (void)n;
+  (void)dst;
+  (void)raw;
+  switch (codec) {
+  case Codec::none:
+    return false;
+  case Codec::lz4:
+#ifdef ORDER_HAVE_LZ4
+    return LZ4_decompress_safe(static_cast<const char *>(src), static_cast<char *>(dst),
+                               static_cast<int>(n), static_cast<int>(raw)) ==
+           static_cast<int>(raw);
+#else
+    return false;
+#endif
+  case Codec::zstd:
+#ifdef ORDER_HAVE_ZSTD
+    return ZSTD_decompress(dst, raw, src, n) == raw;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+} // namespace Order
+
+#endif
@@ -8,9 +8,13 @@ struct compair {
     return a.second < b.second; // Compare based on the integer value
   }
 };
+// The integer compair orders by, so runs can be radix sorted
+struct keypair {
+  int operator()(const stintp &a) const { return a.second; }
+};
 
 int main() {
-  Order::Sorter2048<stintp, compair> manu(4, 40, "temp");
+  Order::Sorter2048<stintp, compair, keypair> manu(4, 1LL << 30, "temp");
   // Genearate random numbers
   int N = 50'000'000;
   int BatchSize = 1'000'00;
@@ -1,358 +1,4450 @@
 #ifndef _ORDER_D_H
 #define _ORDER_D_H
 
+#include "async_io.hpp"
+#include "codec.hpp"
 #include "concurrentqueue.h"
+#include "lightweightsemaphore.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
 #include <queue>
 #include <set>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define ORDER_KEY_LANES 1
+#endif
 
 namespace Order {
 
-// a class K and its comparator C
-template <class K, class C> struct Sorter2048 {
-  struct BatchEntry {
-    K *from;
-    K *to;
-  };
-  struct Job {
-    int id;
-    int level;
-    bool operator<(const Job &other) const {
-      if (level == other.level) {
-        return id > other.id;
+// Byte-accounted budget shared by every buffer the sorter holds in memory.
+// acquire() blocks while the budget is used up; a request larger than the
+// whole budget is still admitted once nothing else is held. Pinned bytes,
+// like a partly filled run only its owner can give back, don't count as
+// held there, or a caller holding one could wait on itself forever.
+// `on_wait` runs each time a caller starts blocking, so whoever can free
+// memory wakes up. acquire() returns true if it had to block.
+class MemoryGovernor {
+public:
+  explicit MemoryGovernor(long long limit, std::function<void()> on_wait = {})
+      : limit(limit), on_wait(std::move(on_wait)) {}
+
+  bool acquire(long long bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    bool blocked = used > pinned && used + bytes > limit;
+    if (blocked) {
+      waiters++;
+      if (on_wait) {
+        on_wait();
+      }
+      cv.wait(lock, [&]() { return used <= pinned || used + bytes <= limit; });
+      waiters--;
+    }
+    used += bytes;
+    return blocked;
+  }
+
+  void release(long long bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      used -= bytes;
+    }
+    cv.notify_all();
+  }
+
+  // Mark acquired bytes as pinned, or no longer so
+  void pin(long long bytes) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pinned += bytes;
+  }
+
+  void unpin(long long bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pinned -= bytes;
+    }
+    cv.notify_all();
+  }
+
+  // True while some caller is blocked in acquire()
+  bool under_pressure() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return waiters > 0;
+  }
+
+  long long in_use() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+  }
+
+  long long budget() const { return limit; }
+
+private:
+  const long long limit;
+  std::function<void()> on_wait;
+  long long used = 0;
+  long long pinned = 0;
+  int waiters = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+};
+
+// Fixed-size slabs carved from one arena reserved up front, after a head
+// region set aside for fixed per-worker buffers. Slabs cycle through a free
+// list, so steady-state use never touches the heap. On Linux the arena is
+// an anonymous mapping that can be backed by huge pages.
+class SlabPool {
+public:
+  static constexpr size_t alignment = 4096;
+
+  SlabPool(size_t head_bytes, size_t slab_bytes, size_t slabs, bool huge_pages)
+      : head_bytes(round_up(head_bytes)), slab_bytes(round_up(slab_bytes)),
+        arena_bytes(this->head_bytes + this->slab_bytes * slabs) {
+#ifdef __linux__
+    void *p = MAP_FAILED;
+    if (huge_pages) {
+      const size_t huge = size_t(2) << 20;
+      mapped_bytes = (arena_bytes + huge - 1) / huge * huge;
+      p = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+      mapped_bytes = arena_bytes;
+      p = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p != MAP_FAILED && huge_pages) {
+        madvise(p, mapped_bytes, MADV_HUGEPAGE);
+      }
+    }
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    arena = static_cast<char *>(p);
+#else
+    (void)huge_pages;
+    arena = static_cast<char *>(
+        ::operator new[](arena_bytes, std::align_val_t{alignment}));
+#endif
+    for (size_t i = slabs; i > 0; i--) {
+      free_slabs.push_back(arena + this->head_bytes + (i - 1) * this->slab_bytes);
+    }
+  }
+  ~SlabPool() {
+#ifdef __linux__
+    munmap(arena, mapped_bytes);
+#else
+    ::operator delete[](arena, std::align_val_t{alignment});
+#endif
+  }
+  SlabPool(const SlabPool &) = delete;
+  SlabPool &operator=(const SlabPool &) = delete;
+
+  static size_t round_up(size_t bytes) {
+    return (bytes + alignment - 1) / alignment * alignment;
+  }
+
+  char *head() { return arena; }
+
+  // A free slab, or nullptr when all of them are out
+  char *borrow() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_slabs.empty()) {
+      return nullptr;
+    }
+    char *slab = free_slabs.back();
+    free_slabs.pop_back();
+    return slab;
+  }
+
+  void give_back(char *slab) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free_slabs.push_back(slab);
+  }
+
+  bool owns(const void *p) const {
+    auto *c = static_cast<const char *>(p);
+    return c >= arena + head_bytes && c < arena + arena_bytes;
+  }
+
+private:
+  const size_t head_bytes;
+  const size_t slab_bytes;
+  const size_t arena_bytes;
+  size_t mapped_bytes = 0;
+  char *arena;
+  std::mutex mutex;
+  std::vector<char *> free_slabs;
+};
+
+// Records whose bytes can go to disk and come back as they are: trivially
+// copyable types, and pairs of them like main.cpp's stintp, whose
+// assignment operator alone keeps it from being trivially copyable
+template <class T> struct raw_record : std::is_trivially_copyable<T> {};
+template <class A, class B>
+struct raw_record<std::pair<A, B>>
+    : std::bool_constant<raw_record<A>::value && raw_record<B>::value> {};
+template <class T> constexpr bool raw_record_v = raw_record<T>::value;
+
+// How a record is laid out in a variable-length run: size() bytes, put
+// there by write() and taken back by read(), which both return the end of
+// what they touched. read() takes the end of the bytes it may touch and
+// returns nullptr if the record would run past it. Covers raw records,
+// std::string and pairs of these; specialize it for anything else that
+// isn't a raw_record.
+template <class T, class Enable = void> struct Serial {
+  static constexpr bool enabled = false;
+};
+
+template <class T> struct Serial<T, std::enable_if_t<raw_record_v<T>>> {
+  static constexpr bool enabled = true;
+  static size_t size(const T &) { return sizeof(T); }
+  static char *write(const T &v, char *out) {
+    std::memcpy(static_cast<void *>(out), static_cast<const void *>(&v), sizeof(T));
+    return out + sizeof(T);
+  }
+  static const char *read(T &v, const char *in, const char *end) {
+    if (static_cast<size_t>(end - in) < sizeof(T)) {
+      return nullptr;
+    }
+    std::memcpy(static_cast<void *>(&v), in, sizeof(T));
+    return in + sizeof(T);
+  }
+};
+
+template <> struct Serial<std::string> {
+  static constexpr bool enabled = true;
+  static size_t size(const std::string &v) { return sizeof(uint32_t) + v.size(); }
+  static char *write(const std::string &v, char *out) {
+    uint32_t n = v.size();
+    std::memcpy(out, &n, sizeof(n));
+    std::memcpy(out + sizeof(n), v.data(), n);
+    return out + sizeof(n) + n;
+  }
+  static const char *read(std::string &v, const char *in, const char *end) {
+    uint32_t n;
+    if (static_cast<size_t>(end - in) < sizeof(n)) {
+      return nullptr;
+    }
+    std::memcpy(&n, in, sizeof(n));
+    if (static_cast<size_t>(end - in) - sizeof(n) < n) {
+      return nullptr;
+    }
+    v.assign(in + sizeof(n), n);
+    return in + sizeof(n) + n;
+  }
+};
+
+template <class A, class B>
+struct Serial<std::pair<A, B>, std::enable_if_t<!raw_record_v<std::pair<A, B>>>> {
+  static constexpr bool enabled = Serial<A>::enabled && Serial<B>::enabled;
+  static size_t size(const std::pair<A, B> &v) {
+    return Serial<A>::size(v.first) + Serial<B>::size(v.second);
+  }
+  static char *write(const std::pair<A, B> &v, char *out) {
+    return Serial<B>::write(v.second, Serial<A>::write(v.first, out));
+  }
+  static const char *read(std::pair<A, B> &v, const char *in, const char *end) {
+    in = Serial<A>::read(v.first, in, end);
+    return in ? Serial<B>::read(v.second, in, end) : nullptr;
+  }
+};
+
+// Size `fd` to `bytes` with its blocks allocated, so a full disk fails
+// here and not as SIGBUS on a store into a mapping of it. Filesystems that
+// can't preallocate are just truncated to size.
+inline bool reserve_file(int fd, size_t bytes) {
+  if (bytes > 0) {
+    int err = posix_fallocate(fd, 0, static_cast<off_t>(bytes));
+    if (err == 0) {
+      return true;
+    }
+    if (err != EINVAL && err != EOPNOTSUPP) {
+      errno = err;
+      return false;
+    }
+  }
+  return ftruncate(fd, static_cast<off_t>(bytes)) == 0;
+}
+
+#ifdef __linux__
+constexpr bool have_mmap = true;
+
+inline size_t page_size() {
+  static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+// Read-only mapping of records [first, first + limit) of a run file, walked
+// one record at a time. Consumed pages are dropped every `release_bytes`,
+// so a merge only keeps a small window of each input resident.
+template <class K> class MappedRunReader {
+public:
+  MappedRunReader(const std::string &path, size_t release_bytes, size_t first = 0,
+                  size_t limit = std::numeric_limits<size_t>::max())
+      : release_bytes(release_bytes) {
+    fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      return;
+    }
+    map_bytes = st.st_size;
+    if (map_bytes > 0) {
+      void *p = mmap(nullptr, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        map_bytes = 0;
+        return;
+      }
+      map = static_cast<char *>(p);
+      madvise(map, map_bytes, MADV_SEQUENTIAL);
+    }
+    size_t count = map_bytes / sizeof(K);
+    first = std::min(first, count);
+    limit = std::min(limit, count - first);
+    pos = reinterpret_cast<const K *>(map) + first;
+    end = pos + limit;
+    released = (first * sizeof(K) + page_size() - 1) / page_size() * page_size();
+    release_at = map + first * sizeof(K) + release_bytes;
+    valid = true;
+  }
+  ~MappedRunReader() {
+    if (map != nullptr) {
+      munmap(map, map_bytes);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  MappedRunReader(const MappedRunReader &) = delete;
+  MappedRunReader &operator=(const MappedRunReader &) = delete;
+
+  bool ok() const { return valid; }
+
+  size_t remaining() const { return end - pos; }
+
+  bool has_more() const { return pos < end; }
+
+  const K &current() const { return *pos; }
+
+  void advance() {
+    ++pos;
+    if (reinterpret_cast<const char *>(pos) >= release_at) {
+      release();
+    }
+  }
+
+private:
+  void release() {
+    size_t upto = (reinterpret_cast<const char *>(pos) - map) / page_size() * page_size();
+    if (upto > released) {
+      madvise(map + released, upto - released, MADV_DONTNEED);
+      released = upto;
+    }
+    release_at = reinterpret_cast<const char *>(pos) + release_bytes;
+  }
+
+  int fd = -1;
+  char *map = nullptr;
+  size_t map_bytes = 0;
+  const K *pos = nullptr;
+  const K *end = nullptr;
+  size_t released = 0;
+  const char *release_at = nullptr;
+  size_t release_bytes;
+  bool valid = false;
+};
+
+// Writable shared mapping of a run file sized up front with reserve_file().
+// Sinks write into slices of it and drop their written pages every
+// `release_bytes`; dirty pages of a shared file mapping stay in the page
+// cache until written back, so nothing is lost.
+template <class K> class MappedRunWriter {
+public:
+  struct Sink {
+    K *pos;
+    char *map;
+    size_t released;
+    const char *release_at;
+    size_t release_bytes;
+
+    void write(const K &item) {
+      *pos++ = item;
+      if (reinterpret_cast<const char *>(pos) >= release_at) {
+        release();
+      }
+    }
+
+    void write_all(const K *from, const K *to) {
+      pos = std::copy(from, to, pos);
+      release();
+    }
+
+    void flush() {}
+
+    void release() {
+      size_t upto = (reinterpret_cast<char *>(pos) - map) / page_size() * page_size();
+      if (upto > released) {
+        madvise(map + released, upto - released, MADV_DONTNEED);
+        released = upto;
+      }
+      release_at = reinterpret_cast<const char *>(pos) + release_bytes;
+    }
+  };
+
+  // Maps the first `records` records of `path`. With `create` the file is
+  // created or truncated and sized to exactly that; otherwise it must
+  // already be at least that long.
+  MappedRunWriter(const std::string &path, size_t records, bool create = true) {
+    fd = open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    map_bytes = records * sizeof(K);
+    if (fd < 0 || (create && !reserve_file(fd, map_bytes))) {
+      return;
+    }
+    if (map_bytes > 0) {
+      void *p = mmap(nullptr, map_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        return;
+      }
+      map = static_cast<char *>(p);
+      madvise(map, map_bytes, MADV_SEQUENTIAL);
+    }
+    valid = true;
+  }
+  ~MappedRunWriter() {
+    if (map != nullptr) {
+      munmap(map, map_bytes);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  MappedRunWriter(const MappedRunWriter &) = delete;
+  MappedRunWriter &operator=(const MappedRunWriter &) = delete;
+
+  bool ok() const { return valid; }
+
+  // Sink writing records from index `first` on
+  Sink slice(size_t first, size_t release_bytes) {
+    size_t start = first * sizeof(K);
+    size_t page = page_size();
+    return Sink{reinterpret_cast<K *>(map + start), map,
+                (start + page - 1) / page * page, map + start + release_bytes,
+                release_bytes};
+  }
+
+private:
+  int fd = -1;
+  char *map = nullptr;
+  size_t map_bytes = 0;
+  bool valid = false;
+};
+#else
+constexpr bool have_mmap = false;
+#endif
+
+#ifdef O_DIRECT
+constexpr bool have_direct_io = true;
+#else
+constexpr bool have_direct_io = false;
+#endif
+
+// Run slice reader keeping the next block in flight on an AsyncIo while the
+// current one is merged. With `try_direct`, a slice starting on a page
+// boundary is read with O_DIRECT; `block_bytes` must then be a page
+// multiple.
+template <class K> class AsyncRunReader {
+public:
+  AsyncRunReader(AsyncIo &aio, const std::string &path, K *a, K *b, size_t block,
+                 size_t first, size_t count, bool try_direct)
+      : aio(aio), buffers{a, b}, block_bytes(block * sizeof(K)) {
+    size_t start = first * sizeof(K);
+#ifdef O_DIRECT
+    if (try_direct && start % 4096 == 0 && block_bytes % 4096 == 0) {
+      fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+      direct = fd >= 0;
+    }
+#else
+    (void)try_direct;
+#endif
+    if (fd < 0) {
+      fd = open(path.c_str(), O_RDONLY);
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      failed = true;
+      return;
+    }
+    size_t records = st.st_size / sizeof(K);
+    first = std::min(first, records);
+    count = std::min(count, records - first);
+    next_off = first * sizeof(K);
+    end_off = next_off + count * sizeof(K);
+    issue();
+    load();
+  }
+  ~AsyncRunReader() {
+    if (in_flight) {
+      aio.wait(ticket);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  AsyncRunReader(const AsyncRunReader &) = delete;
+  AsyncRunReader &operator=(const AsyncRunReader &) = delete;
+
+  bool ok() const { return !failed; }
+
+  bool has_more() const { return pos < end; }
+
+  const K &current() const { return *pos; }
+
+  void advance() {
+    if (++pos == end) {
+      load();
+    }
+  }
+
+private:
+  // Start reading the next block into buffers[filling]
+  void issue() {
+    if (next_off >= end_off) {
+      return;
+    }
+    want = std::min<uint64_t>(block_bytes, end_off - next_off);
+    size_t len = direct ? (want + 4095) / 4096 * 4096 : want;
+    issued_off = next_off;
+    ticket = aio.read(fd, buffers[filling], len, next_off);
+    next_off += want;
+    in_flight = true;
+  }
+
+  // Make the block in flight current and start prefetching the next one
+  void load() {
+    pos = end = nullptr;
+    while (in_flight && pos == end) {
+      long long n = aio.wait(ticket);
+      in_flight = false;
+      if (n < 0) {
+        failed = true;
+        return;
+      }
+      size_t got = std::min<uint64_t>(n, want) / sizeof(K) * sizeof(K);
+      if (got == 0) {
+        // The file ended before the records fstat() counted
+        failed = true;
+        return;
+      }
+      if (got < want) {
+        // Short read: pick up from the first missing record next time
+        next_off = issued_off + got;
+#ifdef O_DIRECT
+        if (direct && next_off % 4096 != 0) {
+          // O_DIRECT can't read from there; do without it from now on
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+          direct = false;
+        }
+#endif
+      }
+      pos = buffers[filling];
+      end = pos + got / sizeof(K);
+      filling ^= 1;
+      issue();
+    }
+  }
+
+  AsyncIo &aio;
+  int fd = -1;
+  K *buffers[2];
+  size_t block_bytes;
+  int filling = 0;
+  uint64_t next_off = 0;
+  uint64_t end_off = 0;
+  uint64_t issued_off = 0;
+  uint64_t want = 0;
+  uint64_t ticket = 0;
+  bool in_flight = false;
+  bool direct = false;
+  bool failed = false;
+  const K *pos = nullptr;
+  const K *end = nullptr;
+};
+
+// Run writer that fills one block while the previous one is written in the
+// background on an AsyncIo. Writes start at record `first`; `create`
+// truncates the file first. O_DIRECT is only used when the writer owns the
+// whole file, since its last block is padded to a page and then trimmed.
+template <class K> class AsyncRunWriter {
+public:
+  AsyncRunWriter(AsyncIo &aio, const std::string &path, K *a, K *b, size_t block,
+                 size_t first, bool create, bool try_direct)
+      : aio(aio), buffers{a, b}, block(block), offset(first * sizeof(K)) {
+    int flags = create ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY;
+#ifdef O_DIRECT
+    if (try_direct && create && first == 0 && (block * sizeof(K)) % 4096 == 0) {
+      fd = open(path.c_str(), flags | O_DIRECT, 0644);
+      direct = fd >= 0;
+    }
+#else
+    (void)try_direct;
+#endif
+    if (fd < 0) {
+      fd = open(path.c_str(), flags, 0644);
+    }
+    failed = fd < 0;
+  }
+  ~AsyncRunWriter() {
+    flush();
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  AsyncRunWriter(const AsyncRunWriter &) = delete;
+  AsyncRunWriter &operator=(const AsyncRunWriter &) = delete;
+
+  bool ok() const { return !failed; }
+
+  void write(const K &item) {
+    buffers[cur][pos++] = item;
+    if (pos == block) {
+      submit();
+    }
+  }
+
+  void write_all(const K *from, const K *to) {
+    while (from < to) {
+      size_t n = std::min<size_t>(block - pos, std::distance(from, to));
+      std::copy(from, from + n, buffers[cur] + pos);
+      pos += n;
+      from += n;
+      if (pos == block) {
+        submit();
+      }
+    }
+  }
+
+  // Write what is buffered and wait for every block to land
+  void flush() {
+    uint64_t end = offset + pos * sizeof(K);
+    bool padded = direct && (pos * sizeof(K)) % 4096 != 0;
+    if (pos > 0) {
+      submit();
+    }
+    wait_slot(0);
+    wait_slot(1);
+    if (padded && ftruncate(fd, end) != 0) {
+      failed = true;
+    }
+  }
+
+private:
+  void submit() {
+    size_t bytes = pos * sizeof(K);
+    size_t len = direct ? (bytes + 4095) / 4096 * 4096 : bytes;
+    tickets[cur] = aio.write(fd, buffers[cur], len, offset);
+    lengths[cur] = bytes;
+    pending[cur] = true;
+    offset += bytes;
+    cur ^= 1;
+    pos = 0;
+    wait_slot(cur);
+  }
+
+  void wait_slot(int i) {
+    if (!pending[i]) {
+      return;
+    }
+    pending[i] = false;
+    long long n = aio.wait(tickets[i]);
+    if (n < 0 || static_cast<size_t>(n) < lengths[i]) {
+      failed = true;
+    }
+  }
+
+  AsyncIo &aio;
+  int fd = -1;
+  K *buffers[2];
+  size_t block;
+  uint64_t offset;
+  size_t pos = 0;
+  int cur = 0;
+  uint64_t tickets[2] = {0, 0};
+  size_t lengths[2] = {0, 0};
+  bool pending[2] = {false, false};
+  bool direct = false;
+  bool failed = false;
+};
+
+// Byte view of a sort key for LSD radix sorting. digit(k, 0) is the least
+// significant byte of the key's natural order: numeric for integers, and
+// lexicographic by unsigned byte for fixed-width byte arrays.
+template <class T, class = void> struct RadixKey {
+  static constexpr bool enabled = false;
+};
+
+template <class T>
+struct RadixKey<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+  static constexpr bool enabled = true;
+  static constexpr size_t digits = sizeof(T);
+  static unsigned digit(T k, size_t i) {
+    using U = std::make_unsigned_t<T>;
+    U u = static_cast<U>(k);
+    if constexpr (std::is_signed_v<T>) {
+      u ^= U(1) << (sizeof(T) * 8 - 1);
+    }
+    return static_cast<unsigned>(u >> (8 * i)) & 0xff;
+  }
+};
+
+template <class B, size_t N>
+struct RadixKey<std::array<B, N>, std::enable_if_t<std::is_integral_v<B> && sizeof(B) == 1>> {
+  static constexpr bool enabled = true;
+  static constexpr size_t digits = N;
+  static unsigned digit(const std::array<B, N> &k, size_t i) {
+    return static_cast<unsigned char>(k[N - 1 - i]);
+  }
+};
+
+// True when KeyFn extracts a key RadixKey understands from a K that can be
+// moved around as raw bytes
+template <class K, class KeyFn> constexpr bool radix_sortable() {
+  if constexpr (std::is_void_v<KeyFn>) {
+    return false;
+  } else {
+    using Key = std::decay_t<std::invoke_result_t<KeyFn, const K &>>;
+    return raw_record_v<K> && RadixKey<Key>::enabled;
+  }
+}
+
+// Stable LSD radix sort of [from, to) by KeyFn, one byte per pass, using
+// `scratch` (room for the same number of records) as the other buffer.
+// Histograms for every digit come from a single read pass, and passes where
+// all keys share the digit are skipped.
+template <class K, class KeyFn> void lsd_radix_sort(K *from, K *to, K *scratch) {
+  using Key = std::decay_t<std::invoke_result_t<KeyFn, const K &>>;
+  using R = RadixKey<Key>;
+  const size_t n = std::distance(from, to);
+  thread_local std::vector<size_t> counts;
+  counts.assign(R::digits * 256, 0);
+  KeyFn key;
+  for (K *k = from; k < to; k++) {
+    const Key &kk = key(*k);
+    for (size_t d = 0; d < R::digits; d++) {
+      counts[d * 256 + R::digit(kk, d)]++;
+    }
+  }
+  K *src = from;
+  K *dst = scratch;
+  for (size_t d = 0; d < R::digits; d++) {
+    size_t *c = &counts[d * 256];
+    if (c[R::digit(key(*src), d)] == n) {
+      continue;
+    }
+    size_t sum = 0;
+    for (int b = 0; b < 256; b++) {
+      size_t cb = c[b];
+      c[b] = sum;
+      sum += cb;
+    }
+    for (K *k = src; k < src + n; k++) {
+      dst[c[R::digit(key(*k), d)]++] = *k;
+    }
+    std::swap(src, dst);
+  }
+  if (src != from) {
+    std::copy(src, src + n, from);
+  }
+}
+
+// Two-way merge of raw records on their KeyFn keys held in SIMD lanes, for
+// integer keys of up to 64 bits. Each step merges the eight records pending
+// with the next eight of the run whose head is lower through a bitonic
+// network, keys in one register and record addresses in the other, and
+// writes out the lower eight. Once either run has fewer than eight left,
+// the pending eight are merged in with what the runs have below them, and
+// the caller finishes the rest. Built for AVX-512 whatever the target flags
+// and used only where the CPU has it. Records wider than 24 bytes are left
+// to the scalar merge, which copying them already holds back more than
+// comparing does.
+template <class K, class KeyFn, class = void> struct KeyLanes {
+  static constexpr bool enabled = false;
+};
+
+#ifdef ORDER_KEY_LANES
+template <class K, class KeyFn> constexpr bool key_lanes_fit() {
+  if constexpr (std::is_void_v<KeyFn> || !raw_record_v<K>) {
+    return false;
+  } else {
+    using Key = std::decay_t<std::invoke_result_t<KeyFn, const K &>>;
+    return std::is_integral_v<Key> && !std::is_same_v<Key, bool> && sizeof(Key) <= 8 &&
+           sizeof(K) <= 24;
+  }
+}
+
+template <class K, class KeyFn>
+struct KeyLanes<K, KeyFn, std::enable_if_t<key_lanes_fit<K, KeyFn>()>> {
+  static constexpr bool enabled = true;
+
+  static bool supported() {
+    static const bool avx512 = __builtin_cpu_supports("avx512f");
+    return avx512;
+  }
+
+  // Advances b1 and b2 past what was written; the rest is the caller's
+  template <class Sink> static void merge(Sink &out, K *&b1, K *b1_end, K *&b2, K *b2_end) {
+    if (supported() && b1_end - b1 >= 8 && b2_end - b2 >= 8) {
+      merge_avx512(out, b1, b1_end, b2, b2_end);
+    }
+  }
+
+private:
+  using Key = std::decay_t<std::invoke_result_t<KeyFn, const K &>>;
+
+  // The key moved so signed 64 bit compares follow its order
+  static long long lane(const K &k) {
+    using U = std::make_unsigned_t<Key>;
+    uint64_t u = static_cast<U>(KeyFn()(k));
+    if constexpr (std::is_signed_v<Key>) {
+      u ^= uint64_t(1) << (sizeof(Key) * 8 - 1);
+    }
+    return static_cast<long long>(u ^ (uint64_t(1) << 63));
+  }
+
+  __attribute__((target("avx512f"))) static void load(const K *p, __m512i &keys, __m512i &at) {
+    keys = _mm512_set_epi64(lane(p[7]), lane(p[6]), lane(p[5]), lane(p[4]), lane(p[3]),
+                            lane(p[2]), lane(p[1]), lane(p[0]));
+    at = _mm512_add_epi64(_mm512_set1_epi64(reinterpret_cast<long long>(p)),
+                          _mm512_set_epi64(7 * sizeof(K), 6 * sizeof(K), 5 * sizeof(K),
+                                           4 * sizeof(K), 3 * sizeof(K), 2 * sizeof(K),
+                                           sizeof(K), 0));
+  }
+
+  // Sort a bitonic register, lanes Distance apart at a time. A lane takes
+  // its partner only when that is strictly lower, or strictly higher in the
+  // upper lane of the pair, so equal keys stay put rather than both copying
+  // one.
+  template <int Distance>
+  __attribute__((target("avx512f"))) static void clean(__m512i &keys, __m512i &at) {
+    const __m512i partner = _mm512_set_epi64(7 ^ Distance, 6 ^ Distance, 5 ^ Distance,
+                                             4 ^ Distance, 3 ^ Distance, 2 ^ Distance,
+                                             1 ^ Distance, 0 ^ Distance);
+    constexpr __mmask8 upper = Distance == 4 ? 0xf0 : Distance == 2 ? 0xcc : 0xaa;
+    __m512i pk = _mm512_maskz_permutexvar_epi64(0xff, partner, keys);
+    __m512i pa = _mm512_maskz_permutexvar_epi64(0xff, partner, at);
+    __mmask8 take = _mm512_mask_cmpgt_epi64_mask(__mmask8(~upper), keys, pk) |
+                    _mm512_mask_cmpgt_epi64_mask(upper, pk, keys);
+    keys = _mm512_mask_blend_epi64(take, keys, pk);
+    at = _mm512_mask_blend_epi64(take, at, pa);
+  }
+
+  __attribute__((target("avx512f"))) static void sort_bitonic(__m512i &keys, __m512i &at) {
+    clean<4>(keys, at);
+    clean<2>(keys, at);
+    clean<1>(keys, at);
+  }
+
+  template <class Sink>
+  __attribute__((target("avx512f"))) static void merge_avx512(Sink &out, K *&b1, K *b1_end,
+                                                             K *&b2, K *b2_end) {
+    const __m512i reverse = _mm512_set_epi64(0, 1, 2, 3, 4, 5, 6, 7);
+    __m512i pk, pa, nk, na;
+    load(b1, pk, pa);
+    b1 += 8;
+    const K *next = b2;
+    b2 += 8;
+    while (true) {
+      load(next, nk, na);
+      // Reversed, the new eight and the pending eight make one bitonic
+      // sequence whose lower half goes out
+      nk = _mm512_maskz_permutexvar_epi64(0xff, reverse, nk);
+      na = _mm512_maskz_permutexvar_epi64(0xff, reverse, na);
+      __mmask8 swap = _mm512_cmpgt_epi64_mask(pk, nk);
+      __m512i lk = _mm512_mask_blend_epi64(swap, pk, nk);
+      __m512i la = _mm512_mask_blend_epi64(swap, pa, na);
+      pk = _mm512_mask_blend_epi64(swap, nk, pk);
+      pa = _mm512_mask_blend_epi64(swap, na, pa);
+      sort_bitonic(lk, la);
+      sort_bitonic(pk, pa);
+      alignas(64) const K *low[8];
+      _mm512_store_si512(low, la);
+      for (const K *k : low) {
+        out.write(*k);
+      }
+      if (b1_end - b1 < 8 || b2_end - b2 < 8) {
+        break;
+      }
+      bool take1 = lane(*b1) < lane(*b2);
+      next = take1 ? b1 : b2;
+      b1 += take1 ? 8 : 0;
+      b2 += take1 ? 0 : 8;
+    }
+    alignas(64) const K *pending[8];
+    _mm512_store_si512(pending, pa);
+    for (const K *k : pending) {
+      long long key = lane(*k);
+      while (true) {
+        bool has1 = b1 < b1_end && lane(*b1) < key;
+        bool has2 = b2 < b2_end && lane(*b2) < key;
+        if (has1 && (!has2 || lane(*b1) < lane(*b2))) {
+          out.write(*b1++);
+        } else if (has2) {
+          out.write(*b2++);
+        } else {
+          break;
+        }
+      }
+      out.write(*k);
+    }
+  }
+};
+#endif
+
+// Snapshot of a sort in progress, from Sorter2048::stats(). Times are
+// summed over workers, so they can exceed wall time.
+struct SortStats {
+  // Records handed to push() so far
+  unsigned long long records_pushed = 0;
+  // Runs sorted in memory, and worker time spent forming runs
+  unsigned long long runs_sorted = 0;
+  double sort_seconds = 0;
+  // Time spent merging or concatenating runs into files
+  double merge_seconds = 0;
+  // Bytes written to run files, and bytes of run files opened for reading
+  unsigned long long bytes_spilled = 0;
+  unsigned long long bytes_read = 0;
+  // Times push() blocked on the memory budget or a full push_queue, and
+  // how long it spent blocked in total
+  unsigned long long push_stalls = 0;
+  double push_stall_seconds = 0;
+  // Batches waiting to be sorted, and sorted runs waiting in memory
+  size_t queued_batches = 0;
+  size_t waitroom_runs = 0;
+  // Run files waiting to be merged, by level
+  std::vector<size_t> files_per_level;
+  // Merges that produced a run at each level; level 0 counts waitroom
+  // pairs written out together
+  std::vector<unsigned long long> merges_per_level;
+  // Bytes charged against maxMem right now
+  long long memory_in_use = 0;
+};
+
+// Spill directories take new runs in turn, or the one with the most free
+// space gets each
+enum class SpillPlacement { round_robin, free_space };
+
+// Tuning knobs for Sorter2048
+struct SortOptions {
+  // Maximum number of runs merged together in one pass
+  int fan_in = 32;
+  // Size of each read or write block used by merges and spills. Every
+  // worker keeps fan_in + 1 blocks, set aside from maxMem up front.
+  size_t io_buffer_bytes = 1 << 20;
+  // Runs with at least this many records are sorted by several workers
+  // together rather than by the one that dequeued them
+  size_t parallel_sort_min = 1 << 20;
+  // Batches that can wait in push_queue before producers block
+  int queue_depth = 10;
+  // Spent push(std::vector&&) buffers kept for reclaim(); extra ones are freed
+  int recycled_buffers = 8;
+  // Back the run and I/O buffer arena with huge pages where available
+  bool huge_pages = false;
+  // Merge through shared mappings of the run files rather than streams.
+  // Only on Linux, and only for K that are raw_record.
+  bool mmap_runs = true;
+  // Prefetch merge inputs and write outputs in the background, on io_uring
+  // where the kernel allows it and a helper thread otherwise. Takes
+  // precedence over mmap_runs and doubles the I/O blocks per stream.
+  bool async_io = false;
+  // With async_io, bypass the page cache with O_DIRECT where alignment
+  // allows. I/O blocks grow to a multiple of both sizeof(K) and 4 KiB.
+  bool direct_io = false;
+  // Compress spilled runs block by block. Only for raw_record K or K with
+  // a Serial<K>, and only if the codec was built in (see codec.hpp).
+  // Compressed runs are streamed, so this overrides mmap_runs and async_io,
+  // and the final merge runs on one thread since runs can't be split by
+  // record. The file finish() returns is then framed too; read it back
+  // through execute() or stream().
+  Codec codec = Codec::none;
+  // lz4 acceleration or zstd level; 0 is the library default
+  int codec_level = 0;
+  // Hold sorted runs in memory until the budget runs out, so a sort that
+  // fits in maxMem never writes a temp file. Once anything spills, pairs
+  // are merged to disk eagerly again.
+  bool in_memory = true;
+  // Generate level 0 runs by replacement selection through a heap holding
+  // half the budget, instead of sorting each run_capacity batch. Runs come
+  // out about twice the heap size on random input and much longer on
+  // partly sorted input, but go through one heap a record at a time and
+  // always go to disk.
+  bool replacement_selection = false;
+  // Records at least this many bytes wide are sorted through an index of
+  // positions and moved once, instead of being swapped around by the sort.
+  // The final gather misses cache on every record, so it only pays off for
+  // wide records; 0 turns this off.
+  size_t index_sort_min = 512;
+  // How new runs are spread over the spill directories. Either way a merge
+  // output avoids the devices its inputs are read from when it can.
+  SpillPlacement spill_placement = SpillPlacement::round_robin;
+  // Called with stats() every stats_interval_ms from a thread of its own,
+  // for as long as the sorter exists. Left empty, no thread is started.
+  std::function<void(const SortStats &)> on_stats;
+  unsigned stats_interval_ms = 1000;
+  // Keep only the first top_k records in sort order; 0 keeps them all.
+  // Every run is cut to top_k records before it is parked or spilled,
+  // and so is every merge output. If top_k records fit in one run, runs
+  // are merged into each other in memory as they are sorted, and
+  // batches are filtered against the worst record still kept. Nothing
+  // then touches the disk. Turns off replacement_selection.
+  size_t top_k = 0;
+  // Keep a manifest of the runs on disk in the first spill directory,
+  // replaced by rename each time a run is spilled or merged. Once finish()
+  // or stream() has spilled all input, a sorter built later over the same
+  // directories with checkpoint set takes over the runs a dead one left:
+  // resumed() is true, and finish() or stream() goes on merging without
+  // anything pushed. Runs of a sort that died while input was still being
+  // pushed are removed. The manifest goes once finish() or stream() hands
+  // the output over.
+  bool checkpoint = false;
+};
+
+// Tournament tree of losers over sorted sources exposing has_more(),
+// current() and advance(). tree[0] holds the overall winner and every
+// internal node the loser of its match, so replacing the winner replays a
+// single leaf-to-root path of log2(n) comparisons.
+template <class K, class C, class Source> class LoserTree {
+public:
+  explicit LoserTree(std::vector<Source *> sources)
+      : sources(std::move(sources)), tree(std::max<size_t>(1, this->sources.size())),
+        heads(this->sources.size()) {
+    size_t n = this->sources.size();
+    for (size_t i = 0; i < n; i++) {
+      heads[i] = head_of(static_cast<int>(i));
+    }
+    if (n == 0) {
+      tree[0] = -1;
+      return;
+    }
+    std::vector<int> winners(2 * n);
+    for (size_t i = 0; i < n; i++) {
+      winners[n + i] = static_cast<int>(i);
+    }
+    for (size_t node = n - 1; node > 0; node--) {
+      int a = winners[2 * node];
+      int b = winners[2 * node + 1];
+      if (beats(a, b)) {
+        winners[node] = a;
+        tree[node] = b;
+      } else {
+        winners[node] = b;
+        tree[node] = a;
+      }
+    }
+    tree[0] = n == 1 ? 0 : winners[1];
+  }
+
+  bool empty() const { return tree[0] < 0 || heads[tree[0]] == nullptr; }
+
+  const K &top() const { return *heads[tree[0]]; }
+
+  // Index of the source holding top()
+  int winner() const { return tree[0]; }
+
+  // Advance the winning source and replay its path to the root
+  void pop() {
+    int w = tree[0];
+    sources[w]->advance();
+    heads[w] = head_of(w);
+    for (size_t node = (sources.size() + w) / 2; node > 0; node /= 2) {
+      if constexpr (branchless) {
+        // Which way a match goes is a coin flip on random keys, so pick
+        // the winner with a mask rather than a mispredicted jump
+        int other = tree[node];
+        int flip = (other ^ w) & -static_cast<int>(beats(other, w));
+        tree[node] = other ^ flip;
+        w ^= flip;
+      } else if (beats(tree[node], w)) {
+        std::swap(tree[node], w);
+      }
+    }
+    tree[0] = w;
+  }
+
+private:
+  // Raw records are cheap to compare twice, so both orders are evaluated
+  // and combined without branching
+  static constexpr bool branchless = raw_record_v<K>;
+
+  // Each source's current record, or null once it runs dry. A source's
+  // current() stays put until it advances, and only the winner advances.
+  const K *head_of(int i) const {
+    return sources[i]->has_more() ? &sources[i]->current() : nullptr;
+  }
+
+  // Exhausted sources lose every match; ties go to the lower index
+  bool beats(int a, int b) const {
+    const K *x = heads[a];
+    const K *y = heads[b];
+    if (y == nullptr) {
+      return true;
+    }
+    if (x == nullptr) {
+      return false;
+    }
+    if constexpr (branchless) {
+      int less = C()(*x, *y);
+      int greater = C()(*y, *x);
+      return less | ((greater ^ 1) & (a < b));
+    } else {
+      if (C()(*x, *y)) {
+        return true;
+      }
+      if (C()(*y, *x)) {
+        return false;
+      }
+      return a < b;
+    }
+  }
+
+  std::vector<Source *> sources;
+  std::vector<int> tree;
+  std::vector<const K *> heads;
+};
+
+// Sorting one data set over several nodes: each node sorts what it holds
+// with a Sorter2048 of its own and passes sample() of its runs to the
+// others. Every node picks the same splitters from the pooled samples, then
+// hands a RangeShuffle to stream_to(), whose send() ships each batch to the
+// node that owns the batch's range; the local output is merged as it is
+// shuffled and never written out whole. Each node pushes what it receives
+// into a second Sorter2048, which finds the sorted runs as they arrive and
+// merges them. The nodes' outputs, in splitter order, make up the whole
+// sorted data set. sort_bench --nodes runs all of this in one process.
+
+// `parts - 1` splitters spread evenly over `samples`. Partition p holds the
+// records ordered at or after splitter p - 1 and before splitter p.
+template <class K, class C> std::vector<K> pick_splitters(std::vector<K> samples, int parts) {
+  std::vector<K> splitters;
+  if (samples.empty() || parts < 2) {
+    return splitters;
+  }
+  std::sort(samples.begin(), samples.end(), C());
+  for (int p = 1; p < parts; p++) {
+    splitters.push_back(samples[p * samples.size() / parts]);
+  }
+  return splitters;
+}
+
+// Routes records to the partition that owns them under `splitters` and
+// hands them on in batches of up to `batch` records through `send`.
+// Records with equal keys always go to the same partition. Sorted input
+// is routed without a search per record. One instance per thread.
+template <class K, class C> class RangeShuffle {
+public:
+  using Send = std::function<void(int part, K *from, K *to)>;
+
+  RangeShuffle(std::vector<K> splitters, Send send, size_t batch = 1 << 16)
+      : splitters(std::move(splitters)), send(std::move(send)),
+        batch(std::max<size_t>(1, batch)), buffers(this->splitters.size() + 1) {}
+
+  int parts() const { return static_cast<int>(buffers.size()); }
+
+  // Partition that `rec` belongs to
+  int owner(const K &rec) const {
+    return std::upper_bound(splitters.begin(), splitters.end(), rec, C()) -
+           splitters.begin();
+  }
+
+  void push(const K &rec) {
+    // Sorted input stays in the last record's partition or moves up from it
+    if (!owns(last, rec)) {
+      last = owner(rec);
+    }
+    std::vector<K> &buffer = buffers[last];
+    buffer.push_back(rec);
+    if (buffer.size() >= batch) {
+      ship(last);
+    }
+  }
+
+  void push(const K *from, const K *to) {
+    for (; from != to; from++) {
+      push(*from);
+    }
+  }
+
+  // Send whatever is still buffered
+  void flush() {
+    for (int p = 0; p < parts(); p++) {
+      ship(p);
+    }
+  }
+
+private:
+  bool owns(int p, const K &rec) const {
+    return (p == 0 || !C()(rec, splitters[p - 1])) &&
+           (p == static_cast<int>(splitters.size()) || C()(rec, splitters[p]));
+  }
+
+  void ship(int p) {
+    std::vector<K> &buffer = buffers[p];
+    if (!buffer.empty()) {
+      send(p, buffer.data(), buffer.data() + buffer.size());
+      buffer.clear();
+    }
+  }
+
+  std::vector<K> splitters;
+  Send send;
+  size_t batch;
+  std::vector<std::vector<K>> buffers;
+  int last = 0;
+};
+
+// a class K and its comparator C. An optional KeyFn maps a K to an
+// integer or fixed-width byte key that C orders the same way; run formation
+// then radix sorts on that key instead of calling C. An optional Reduce
+// folds records C finds equal: Reduce()(into, other) merges `other` into
+// `into`, and the output keeps one record per key.
+template <class K, class C, class KeyFn = void, class Reduce = void> struct Sorter2048 {
+  static constexpr bool radix = radix_sortable<K, KeyFn>();
+  static constexpr bool reducing = !std::is_void_v<Reduce>;
+  // Records that aren't raw bytes go to disk through Serial<K>, in the
+  // framed run format shared with compressed runs
+  static constexpr bool varlen = !raw_record_v<K> && Serial<K>::enabled;
+
+  struct BatchEntry {
+    K *from;
+    K *to;
+    // Set when the buffer was moved in by push(std::vector<K> &&)
+    std::vector<K> *owner = nullptr;
+    // Bytes the records keep outside the buffer, charged to the budget
+    // when pushed; only Serial<K> records have any
+    size_t heap_bytes = 0;
+  };
+  // Run buffer being filled by push(). Each copying producer holds a
+  // reference, plus one for the builder while the run is still open; the
+  // last reference to go hands the run to push_queue.
+  struct RunBuilder {
+    K *buffer;
+    size_t capacity;
+    size_t fill;
+    std::atomic<int> refs;
+    std::atomic<size_t> heap_bytes{0};
+  };
+  // Running totals behind stats(), bumped without locks. Merges above the
+  // last level slot are counted in it.
+  static constexpr int stat_levels = 32;
+  struct Counters {
+    std::atomic<unsigned long long> records_pushed{0};
+    std::atomic<unsigned long long> runs_sorted{0};
+    std::atomic<unsigned long long> sort_ns{0};
+    std::atomic<unsigned long long> merge_ns{0};
+    std::atomic<unsigned long long> bytes_spilled{0};
+    std::atomic<unsigned long long> bytes_read{0};
+    std::atomic<unsigned long long> push_stalls{0};
+    std::atomic<unsigned long long> push_stall_ns{0};
+    std::array<std::atomic<unsigned long long>, stat_levels> merges{};
+
+    void merged(int level) { merges[std::min(level, stat_levels - 1)]++; }
+  };
+  // Adds the time until it goes out of scope to a counter
+  struct ScopedTimer {
+    std::atomic<unsigned long long> &ns;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    ~ScopedTimer() { ns += elapsed_ns(start); }
+  };
+  static unsigned long long elapsed_ns(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - since)
+        .count();
+  }
+  struct Job {
+    int id;
+    int level;
+    // Index into spill_dirs
+    int dir = 0;
+    // Smallest and largest record, when known. Runs whose ranges don't
+    // overlap are concatenated instead of merged.
+    bool bounded = false;
+    K lo{};
+    K hi{};
+    // Records in the run. JQ keeps the smallest runs first, so those are
+    // the ones merged first.
+    size_t records = 0;
+    bool operator<(const Job &other) const {
+      if (records == other.records) {
+        return id > other.id;
+      }
+      return records < other.records;
+    }
+    std::string filename() const {
+      return std::to_string(id) + "_" + std::to_string(level) + ".tmp";
+    }
+  };
+
+  // Helper function to read a single item from a binary stream
+  static bool read_item(std::ifstream &in, K &item) {
+    return static_cast<bool>(in.read(reinterpret_cast<char *>(&item), sizeof(K)));
+  }
+
+  // Helper function to write a single item to a binary stream
+  static void write_item(std::ofstream &out, const K &item) {
+    out.write(reinterpret_cast<const char *>(&item), sizeof(K));
+  }
+
+  // Batched reader for efficient file reading. `limit` caps how many
+  // records are read, so a reader can cover a slice of a run.
+  struct BatchedReader {
+    std::ifstream &file;
+    K *buffer;
+    size_t buffer_size;
+    size_t pos;
+    size_t count;
+    size_t remaining;
+    bool exhausted;
+
+    BatchedReader(std::ifstream &f, K *buf, size_t buf_size,
+                  size_t limit = std::numeric_limits<size_t>::max())
+        : file(f), buffer(buf), buffer_size(buf_size), pos(0), count(0),
+          remaining(limit), exhausted(false) {
+      refill();
+    }
+
+    void refill() {
+      if (exhausted) return;
+      size_t want = std::min(buffer_size, remaining);
+      file.read(reinterpret_cast<char *>(buffer), want * sizeof(K));
+      size_t bytes_read = file.gcount();
+      count = bytes_read / sizeof(K);
+      remaining -= count;
+      pos = 0;
+      if (count == 0) {
+        exhausted = true;
+      }
+    }
+
+    bool ok() const { return !file.bad(); }
+
+    bool has_more() const { return !exhausted; }
+
+    const K &current() const { return buffer[pos]; }
+
+    void advance() {
+      pos++;
+      if (pos >= count) {
+        refill();
+      }
+    }
+  };
+
+  // Batched writer for efficient file writing
+  struct BatchedWriter {
+    std::ofstream &file;
+    K *buffer;
+    size_t buffer_size;
+    size_t pos;
+
+    BatchedWriter(std::ofstream &f, K *buf, size_t buf_size)
+        : file(f), buffer(buf), buffer_size(buf_size), pos(0) {}
+
+    void write(const K &item) {
+      buffer[pos++] = item;
+      if (pos >= buffer_size) {
+        flush();
+      }
+    }
+
+    void flush() {
+      if (pos > 0) {
+        file.write(reinterpret_cast<const char *>(buffer), pos * sizeof(K));
+        pos = 0;
+      }
+    }
+
+    // Write a sorted range straight from memory, one block per call
+    void write_all(const K *from, const K *to) {
+      flush();
+      while (from < to) {
+        size_t n = std::min<size_t>(buffer_size, std::distance(from, to));
+        file.write(reinterpret_cast<const char *>(from), n * sizeof(K));
+        from += n;
+      }
+    }
+  };
+
+  // Compressed runs are a sequence of frames, one per block: the raw byte
+  // count, the packed byte count (0 if the block is stored as is), then the
+  // payload.
+  struct FrameHeader {
+    uint32_t raw;
+    uint32_t packed;
+  };
+
+  // Reads a compressed run frame by frame. `packed` holds one block's worth
+  // of compressed bytes.
+  struct PackedReader {
+    std::ifstream &file;
+    K *buffer;
+    char *packed;
+    size_t buffer_size;
+    Codec codec;
+    size_t pos;
+    size_t count;
+    bool exhausted;
+    bool failed;
+
+    PackedReader(std::ifstream &f, K *buf, char *packed, size_t buf_size, Codec codec)
+        : file(f), buffer(buf), packed(packed), buffer_size(buf_size), codec(codec),
+          pos(0), count(0), exhausted(false), failed(false) {
+      refill();
+    }
+
+    void refill() {
+      pos = count = 0;
+      FrameHeader h;
+      while (count == 0 && !exhausted) {
+        if (!file.read(reinterpret_cast<char *>(&h), sizeof(h))) {
+          exhausted = true;
+          break;
+        }
+        size_t stored = h.packed ? h.packed : h.raw;
+        char *into = h.packed ? packed : reinterpret_cast<char *>(buffer);
+        if (h.raw > buffer_size * sizeof(K) || h.raw % sizeof(K) != 0 ||
+            stored > buffer_size * sizeof(K) ||
+            !file.read(into, stored) ||
+            (h.packed && !decode_block(codec, packed, h.packed, buffer, h.raw))) {
+          failed = exhausted = true;
+          break;
+        }
+        count = h.raw / sizeof(K);
+      }
+    }
+
+    bool ok() const { return !failed; }
+
+    bool has_more() const { return pos < count; }
+
+    const K &current() const { return buffer[pos]; }
+
+    void advance() {
+      pos++;
+      if (pos >= count) {
+        refill();
+      }
+    }
+  };
+
+  // Writes a run as compressed frames, one per filled block
+  struct PackedWriter {
+    std::ofstream &file;
+    K *buffer;
+    char *packed;
+    size_t buffer_size;
+    Codec codec;
+    int level;
+    size_t pos;
+
+    PackedWriter(std::ofstream &f, K *buf, char *packed, size_t buf_size, Codec codec,
+                 int level)
+        : file(f), buffer(buf), packed(packed), buffer_size(buf_size), codec(codec),
+          level(level), pos(0) {}
+
+    void write(const K &item) {
+      buffer[pos++] = item;
+      if (pos >= buffer_size) {
+        flush();
+      }
+    }
+
+    void flush() {
+      if (pos > 0) {
+        write_frame(buffer, pos);
+        pos = 0;
+      }
+    }
+
+    void write_all(const K *from, const K *to) {
+      flush();
+      while (from < to) {
+        size_t n = std::min<size_t>(buffer_size, std::distance(from, to));
+        write_frame(from, n);
+        from += n;
+      }
+    }
+
+    void write_frame(const K *from, size_t n) {
+      FrameHeader h{static_cast<uint32_t>(n * sizeof(K)), 0};
+      h.packed = encode_block(codec, level, from, h.raw, packed, h.raw);
+      file.write(reinterpret_cast<const char *>(&h), sizeof(h));
+      if (h.packed) {
+        file.write(packed, h.packed);
+      } else {
+        file.write(reinterpret_cast<const char *>(from), h.raw);
+      }
+    }
+  };
+
+  // Reads a run of Serial<K> records: frames whose payload, once unpacked,
+  // is a sequence of records each led by its byte length. A frame's
+  // records are decoded into `records` together.
+  struct VarReader {
+    std::ifstream &file;
+    char *bytes;
+    char *packed;
+    size_t capacity;
+    Codec codec;
+    std::vector<char> oversized;
+    std::vector<K> records;
+    size_t pos = 0;
+    bool failed = false;
+
+    VarReader(std::ifstream &f, char *bytes, char *packed, size_t capacity, Codec codec)
+        : file(f), bytes(bytes), packed(packed), capacity(capacity), codec(codec) {
+      refill();
+    }
+
+    void refill() {
+      records.clear();
+      pos = 0;
+      FrameHeader h;
+      while (records.empty() && file.read(reinterpret_cast<char *>(&h), sizeof(h))) {
+        size_t stored = h.packed ? h.packed : h.raw;
+        char *raw = bytes;
+        if (h.raw > capacity) {
+          // A lone record wider than a block gets a frame of its own
+          oversized.resize(h.raw);
+          raw = oversized.data();
+        }
+        char *into = h.packed ? packed : raw;
+        if (stored > std::max(capacity, size_t(h.raw)) ||
+            (h.packed && h.packed > capacity) || !file.read(into, stored) ||
+            (h.packed && !decode_block(codec, packed, h.packed, raw, h.raw)) ||
+            !decode(raw, raw + h.raw)) {
+          failed = true;
+          records.clear();
+          return;
+        }
+      }
+    }
+
+    bool decode(const char *in, const char *end) {
+      while (in < end) {
+        uint32_t len;
+        if (end - in < static_cast<ptrdiff_t>(sizeof(len))) {
+          return false;
+        }
+        std::memcpy(&len, in, sizeof(len));
+        in += sizeof(len);
+        if (static_cast<size_t>(end - in) < len) {
+          return false;
+        }
+        records.emplace_back();
+        if (Serial<K>::read(records.back(), in, in + len) != in + len) {
+          return false;
+        }
+        in += len;
+      }
+      return true;
+    }
+
+    bool ok() const { return !failed; }
+
+    bool has_more() const { return pos < records.size(); }
+
+    const K &current() const { return records[pos]; }
+
+    void advance() {
+      if (++pos >= records.size()) {
+        refill();
+      }
+    }
+  };
+
+  // Writes Serial<K> records into frames of up to `capacity` bytes
+  struct VarWriter {
+    std::ofstream &file;
+    char *bytes;
+    char *packed;
+    size_t capacity;
+    Codec codec;
+    int level;
+    size_t fill = 0;
+    std::vector<char> oversized;
+
+    VarWriter(std::ofstream &f, char *bytes, char *packed, size_t capacity, Codec codec,
+              int level)
+        : file(f), bytes(bytes), packed(packed), capacity(capacity), codec(codec),
+          level(level) {}
+
+    void write(const K &item) {
+      size_t need = sizeof(uint32_t) + Serial<K>::size(item);
+      if (fill + need > capacity) {
+        flush();
+      }
+      char *out = bytes + fill;
+      if (need > capacity) {
+        oversized.resize(need);
+        out = oversized.data();
+      }
+      uint32_t len = need - sizeof(uint32_t);
+      std::memcpy(out, &len, sizeof(len));
+      Serial<K>::write(item, out + sizeof(len));
+      if (need > capacity) {
+        write_frame(out, need);
+      } else {
+        fill += need;
+      }
+    }
+
+    void write_all(const K *from, const K *to) {
+      for (; from != to; from++) {
+        write(*from);
+      }
+    }
+
+    void flush() {
+      if (fill > 0) {
+        write_frame(bytes, fill);
+        fill = 0;
+      }
+    }
+
+    void write_frame(const char *raw, size_t n) {
+      FrameHeader h{static_cast<uint32_t>(n), 0};
+      if (codec != Codec::none && n <= capacity) {
+        h.packed = encode_block(codec, level, raw, n, packed, n);
+      }
+      file.write(reinterpret_cast<const char *>(&h), sizeof(h));
+      file.write(h.packed ? packed : raw, h.packed ? h.packed : n);
+    }
+  };
+
+  // Per-worker block buffers for run I/O: `per_stream` page aligned blocks
+  // for each merge input and for the output, and a run sized radix sort
+  // buffer when KeyFn allows it. They live in the head of the slab pool's
+  // arena for the sorter's whole lifetime. `aio` is set with async_io.
+  struct IoScratch {
+    size_t block;
+    size_t stride_bytes;
+    int fan_in;
+    int per_stream;
+    char *base;
+    K *sort_scratch;
+    std::unique_ptr<AsyncIo> aio;
+
+    IoScratch(size_t block_bytes, int fan_in, int per_stream, char *base,
+              K *sort_scratch)
+        : block(std::max<size_t>(1, block_bytes / sizeof(K))),
+          stride_bytes(stride_for(block_bytes)), fan_in(fan_in),
+          per_stream(per_stream), base(base), sort_scratch(sort_scratch) {}
+
+    static size_t stride_for(size_t block_bytes) {
+      size_t bytes = std::max<size_t>(1, block_bytes / sizeof(K)) * sizeof(K);
+      return SlabPool::round_up(bytes);
+    }
+
+    static size_t bytes_for(size_t block_bytes, int fan_in, int per_stream) {
+      return stride_for(block_bytes) * (fan_in + 1) * per_stream;
+    }
+
+    K *block_at(int i) { return reinterpret_cast<K *>(base + i * stride_bytes); }
+
+    K *reader(int i, int half = 0) { return block_at(i * per_stream + half); }
+
+    K *writer(int half = 0) { return reader(fan_in, half); }
+
+    // The same blocks as raw bytes, for framed runs of Serial<K> records
+    char *byte_block(int i, int half) {
+      return base + (i * per_stream + half) * stride_bytes;
+    }
+  };
+
+  // Merge two in-memory sorted ranges and write to file
+  template <class Sink>
+  static void merge_to_file(Sink &out, K *&b1, K *b1_end, K *&b2, K *b2_end) {
+    if constexpr (KeyLanes<K, KeyFn>::enabled) {
+      KeyLanes<K, KeyFn>::merge(out, b1, b1_end, b2, b2_end);
+    }
+    while (b1 < b1_end && b2 < b2_end) {
+      if constexpr (raw_record_v<K>) {
+        // Step both cursors by the comparison instead of branching on it
+        size_t first = C()(*b1, *b2);
+        out.write(first ? *b1 : *b2);
+        b1 += first;
+        b2 += first ^ 1;
+      } else if (C()(*b1, *b2)) {
+        out.write(*b1++);
+      } else {
+        out.write(*b2++);
+      }
+    }
+    while (b1 < b1_end) {
+      out.write(*b1++);
+    }
+    while (b2 < b2_end) {
+      out.write(*b2++);
+    }
+    out.flush();
+  }
+
+  // Merge sorted sources into a sink, stopping after `limit` records
+  template <class Sources, class Sink>
+  static void merge_sources(Sources &readers, Sink &out, size_t limit = to_end) {
+    using Source = typename Sources::value_type;
+    std::vector<Source *> sources;
+    for (auto &r : readers) {
+      sources.push_back(&r);
+    }
+    LoserTree<K, C, Source> tree(std::move(sources));
+    for (size_t n = 0; n < limit && !tree.empty(); n++) {
+      out.write(tree.top());
+      tree.pop();
+    }
+    out.flush();
+  }
+
+  // Read the record at `idx` of a run file
+  static K read_at(std::ifstream &in, size_t idx) {
+    K k;
+    in.clear();
+    in.seekg(idx * sizeof(K));
+    read_item(in, k);
+    return k;
+  }
+
+  // Index of the first record in a run file not ordered before `key`
+  static size_t lower_bound_in_file(std::ifstream &in, size_t count, const K &key) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (C()(read_at(in, mid), key)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // Size initial runs so the runs being sorted (with their radix buffers),
+  // the waitroom pair and the run being filled all fit in the budget
+  static size_t pick_run_capacity(int threads, long long budget, bool record_scratch) {
+    long long slot = budget / ((record_scratch ? 2 * threads : threads) + 2);
+    return std::max<size_t>(1, slot / sizeof(K));
+  }
+
+  // Shrink I/O blocks if needed so worker scratch takes at most half of
+  // maxMem. O_DIRECT blocks are whole multiples of both the record and the
+  // page size, so every block boundary stays aligned.
+  static size_t pick_io_block_bytes(int threads, int fan_in, int per_stream,
+                                    long long maxMem, size_t requested,
+                                    bool direct) {
+    long long cap = maxMem / 2 /
+                    (static_cast<long long>(threads) * (fan_in + 1) * per_stream);
+    size_t bytes = std::max<long long>(sizeof(K), std::min<long long>(requested, cap));
+    if (direct) {
+      size_t unit = std::lcm(sizeof(K), size_t(4096));
+      bytes = std::max(unit, bytes / unit * unit);
+    }
+    return bytes;
+  }
+
+  // Async streams double buffer; compressed ones keep a packed block aside
+  static Codec pick_codec(Codec requested) {
+    if (!raw_record_v<K> && !varlen) {
+      return Codec::none;
+    }
+    if (!codec_available(requested)) {
+      std::cerr << "Spill codec not built in, writing runs uncompressed" << std::endl;
+      return Codec::none;
+    }
+    return requested;
+  }
+
+  // Radix sorting whole records needs a run sized buffer on each worker;
+  // index sorting doesn't
+  bool record_scratch() const { return radix && !index_sort; }
+
+  int buffers_per_stream() const { return async_io || codec != Codec::none ? 2 : 1; }
+
+  // Budget left once every worker has its I/O blocks
+  long long io_budget() const {
+    long long scratch =
+        static_cast<long long>(threads) *
+        IoScratch::bytes_for(io_block_bytes, fan_in, buffers_per_stream());
+    return std::max(0LL, maxMem - scratch);
+  }
+
+  // Arena head bytes each worker owns for its whole lifetime
+  size_t worker_head_bytes() const {
+    size_t bytes = IoScratch::bytes_for(io_block_bytes, fan_in, buffers_per_stream());
+    if (record_scratch()) {
+      bytes += SlabPool::round_up(run_capacity * sizeof(K));
+    }
+    return bytes;
+  }
+
+  // Budget left for run buffers once every worker has its scratch
+  long long run_budget() const {
+    long long head = static_cast<long long>(threads) * worker_head_bytes();
+    return std::max(0LL, maxMem - head - heap_budget());
+  }
+
+  // Bytes set aside for the replacement selection heap and its out block
+  long long heap_budget() const { return replacement ? io_budget() / 2 : 0; }
+
+  // Slabs the run budget can have out at once
+  static size_t pick_run_slabs(size_t run_capacity, long long budget) {
+    return std::max<long long>(1, budget / static_cast<long long>(run_capacity * sizeof(K)));
+  }
+
+  // `maxMem` is in bytes
+  Sorter2048(int threads, long long maxMem, const std::string &workdir,
+             const SortOptions &options = SortOptions())
+      : Sorter2048(threads, maxMem, std::vector<std::string>{workdir}, options) {}
+
+  // Spill runs over several directories, ideally one per drive
+  Sorter2048(int threads, long long maxMem, const std::vector<std::string> &workdirs,
+             const SortOptions &options = SortOptions())
+      : done(false), threads(std::max(1, threads)), maxMem(maxMem),
+        fan_in(std::max(2, options.fan_in)),
+        codec(pick_codec(options.codec)), codec_level(options.codec_level),
+        async_io(options.async_io && raw_record_v<K> &&
+                 codec == Codec::none),
+        direct_io(async_io && options.direct_io && have_direct_io),
+        io_block_bytes(pick_io_block_bytes(this->threads, fan_in,
+                                           buffers_per_stream(), maxMem,
+                                           options.io_buffer_bytes, direct_io)),
+        recycled_buffers(options.recycled_buffers),
+        parallel_sort_min(options.parallel_sort_min),
+        mapped_io(have_mmap && raw_record_v<K> && options.mmap_runs &&
+                  codec == Codec::none),
+        in_memory(options.in_memory),
+        replacement(options.replacement_selection && options.top_k == 0),
+        index_sort(options.index_sort_min > 0 && sizeof(K) >= options.index_sort_min),
+        top_k(options.top_k), checkpointing(options.checkpoint),
+        spill_placement(options.spill_placement),
+        push_queue(options.queue_depth, this->threads, 1),
+        free_slots(std::max(1, options.queue_depth)),
+        run_capacity(pick_run_capacity(this->threads, io_budget() - heap_budget(),
+                                       record_scratch())),
+        memory(run_budget(), [this]() { work.signal(); }),
+        pool(this->threads * worker_head_bytes(), run_capacity * sizeof(K),
+             pick_run_slabs(run_capacity, run_budget()), options.huge_pages) {
+    hold_top = top_k > 0 && top_k <= run_capacity;
+    for (const std::string &dir : workdirs.empty() ? std::vector<std::string>{"."}
+                                                   : workdirs) {
+      std::filesystem::create_directories(dir);
+      struct stat st;
+      spill_dirs.push_back(dir);
+      spill_prefixes.push_back(dir + "/B");
+      spill_devices.push_back(stat(dir.c_str(), &st) == 0 ? st.st_dev : 0);
+    }
+    workdir = spill_dirs[0];
+    work_file_prefix = spill_prefixes[0];
+    spill_free = std::make_unique<std::atomic<std::uintmax_t>[]>(spill_dirs.size());
+    for (const std::string &prefix : spill_prefixes) {
+      note_free_space(prefix);
+    }
+    if (checkpointing) {
+      resume();
+    }
+    for (int i = 0; i < this->threads; i++) {
+      char *head = pool.head() + i * worker_head_bytes();
+      char *io_end =
+          head + IoScratch::bytes_for(io_block_bytes, fan_in, buffers_per_stream());
+      scratch.push_back(std::make_unique<IoScratch>(
+          io_block_bytes, fan_in, buffers_per_stream(), head,
+          record_scratch() ? reinterpret_cast<K *>(io_end) : nullptr));
+      if (async_io) {
+        scratch.back()->aio = std::make_unique<AsyncIo>();
+      }
+    }
+    if (replacement) {
+      rs_block.resize(std::max<size_t>(1, std::min<size_t>(io_block_bytes, heap_budget() / 2) / sizeof(K)));
+      if (varlen) {
+        rs_bytes.resize(rs_block.size() * sizeof(K));
+      }
+      if (codec != Codec::none) {
+        rs_packed.resize(rs_block.size() * sizeof(K));
+      }
+      long long heap_bytes = heap_budget() - static_cast<long long>(
+                                                 rs_block.size() * sizeof(K) + rs_packed.size() + rs_bytes.size());
+      rs_capacity = std::max<long long>(1, heap_bytes / static_cast<long long>(sizeof(Tagged)));
+      rs_heap.reserve(rs_capacity);
+    }
+    for (int i = 0; i < this->threads; i++) {
+      workers.emplace_back([this, i]() { manage_sorting(*scratch[i]); });
+    }
+    if (options.on_stats) {
+      reporter = std::thread([this, f = options.on_stats,
+                              every = std::chrono::milliseconds(
+                                  std::max(1u, options.stats_interval_ms))]() {
+        std::unique_lock<std::mutex> lock(report_mutex);
+        while (!report_cv.wait_for(lock, every, [this]() { return !reporting; })) {
+          lock.unlock();
+          f(stats());
+          lock.lock();
+        }
+      });
+    }
+  }
+  ~Sorter2048() {
+    if (reporter.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(report_mutex);
+        reporting = false;
+      }
+      report_cv.notify_all();
+      reporter.join();
+    }
+    stop_workers();
+    for (const BatchEntry &b : resident) {
+      free_batch(b);
+    }
+    std::vector<K> *spent;
+    while (spent_buffers.try_dequeue(spent)) {
+      delete spent;
+    }
+  }
+
+  // Raise `done` and wake every idle worker so it can see it
+  void stop_workers() {
+    done.store(true);
+    work.signal(threads);
+    for (auto &w : workers) {
+      if (w.joinable()) {
+        w.join();
+      }
+    }
+  }
+
+  // A run_capacity buffer from the slab pool, or from the heap if the pool
+  // is somehow drained. Only types that need it get constructed in place.
+  K *allocate_run() {
+    char *slab = pool.borrow();
+    if (slab == nullptr) {
+      return new K[run_capacity];
+    }
+    K *run = reinterpret_cast<K *>(slab);
+    if constexpr (!std::is_trivially_copyable_v<K>) {
+      std::uninitialized_default_construct_n(run, run_capacity);
+    }
+    return run;
+  }
+
+  void free_run(K *run) {
+    if (!pool.owns(run)) {
+      delete[] run;
+      return;
+    }
+    if constexpr (!std::is_trivially_copyable_v<K>) {
+      std::destroy_n(run, run_capacity);
+    }
+    pool.give_back(reinterpret_cast<char *>(run));
+  }
+
+  // Give a batch buffer back to the budget. Moved-in vectors are offered
+  // to reclaim() instead, and stop being charged once they wait there.
+  void free_batch(const BatchEntry &b) {
+    free_storage(b);
+    memory.release(static_cast<long long>((b.to - b.from) * sizeof(K) + b.heap_bytes));
+  }
+
+  // What records in [from, to) hold outside their sizeof(K), going by
+  // their encoded size. std::string and the like keep their bytes on the
+  // heap, which maxMem has to cover too.
+  static size_t heap_bytes_of(const K *from, const K *to) {
+    size_t bytes = 0;
+    if constexpr (varlen) {
+      for (; from != to; from++) {
+        bytes += Serial<K>::size(*from);
+      }
+    }
+    return bytes;
+  }
+
+  // Free or recycle a batch buffer without touching the budget
+  void free_storage(const BatchEntry &b) {
+    if (b.owner == nullptr) {
+      free_run(b.from);
+    } else if (spent_count.fetch_add(1) < recycled_buffers) {
+      b.owner->clear();
+      spent_buffers.enqueue(b.owner);
+    } else {
+      spent_count--;
+      delete b.owner;
+    }
+  }
+
+  // Piece of a run being sorted cooperatively. The worker that brings
+  // `pending` to zero signals `finished`. When `scratch` is set, it mirrors
+  // the run starting at `run`, so each piece radix sorts in its own slice.
+  struct SortTask {
+    K *from;
+    K *to;
+    size_t grain;
+    K *run;
+    K *scratch;
+    std::atomic<size_t> *pending;
+    moodycamel::LightweightSemaphore *finished;
+  };
+
+  // Move from[order[i]] to position i for every i, following cycles so
+  // each record moves once
+  static void permute(K *from, std::vector<uint32_t> &order) {
+    for (uint32_t i = 0; i < order.size(); i++) {
+      if (order[i] == i) {
+        continue;
+      }
+      K held = std::move(from[i]);
+      uint32_t j = i;
+      while (order[j] != i) {
+        uint32_t k = order[j];
+        from[j] = std::move(from[k]);
+        order[j] = j;
+        j = k;
+      }
+      from[j] = std::move(held);
+      order[j] = j;
+    }
+  }
+
+  // Sort wide records by sorting their positions, then permuting once.
+  // With a radix key, (key, position) pairs are radix sorted so the sort
+  // itself never touches the records. The index lives in per-thread
+  // buffers outside maxMem, a few bytes per record.
+  static void sort_indexed(K *from, K *to) {
+    const size_t n = std::distance(from, to);
+    thread_local std::vector<uint32_t> order;
+    order.resize(n);
+    if constexpr (radix) {
+      using Key = std::decay_t<std::invoke_result_t<KeyFn, const K &>>;
+      struct Keyed {
+        Key key;
+        uint32_t pos;
+      };
+      struct KeyOf {
+        const Key &operator()(const Keyed &k) const { return k.key; }
+      };
+      thread_local std::vector<Keyed> keyed;
+      thread_local std::vector<Keyed> spare;
+      keyed.resize(n);
+      spare.resize(n);
+      KeyFn key;
+      for (uint32_t i = 0; i < n; i++) {
+        keyed[i] = Keyed{key(from[i]), i};
+      }
+      lsd_radix_sort<Keyed, KeyOf>(keyed.data(), keyed.data() + n, spare.data());
+      for (size_t i = 0; i < n; i++) {
+        order[i] = keyed[i].pos;
+      }
+    } else {
+      std::iota(order.begin(), order.end(), 0);
+      std::sort(order.begin(), order.end(),
+                [from](uint32_t a, uint32_t b) { return C()(from[a], from[b]); });
+    }
+    permute(from, order);
+  }
+
+  void sort_leaf(K *from, K *to, K *scratch) const {
+    if (index_sort && std::distance(from, to) >= 64 &&
+        static_cast<size_t>(std::distance(from, to)) <= UINT32_MAX) {
+      sort_indexed(from, to);
+      return;
+    }
+    if constexpr (radix) {
+      if (scratch != nullptr && std::distance(from, to) >= 64) {
+        lsd_radix_sort<K, KeyFn>(from, to, scratch);
+        return;
+      }
+    }
+    std::sort(from, to, C());
+  }
+
+  // Quicksort step: split off the upper part of the range around a median
+  // of three pivot and offer it to other workers, keeping the lower part.
+  // Records equal to the pivot are already in place, so each split makes
+  // progress even on heavy duplicates.
+  void run_sort_task(SortTask t) {
+    while (static_cast<size_t>(t.to - t.from) > t.grain) {
+      K a = t.from[0];
+      K b = t.from[(t.to - t.from) / 2];
+      K c = t.to[-1];
+      C less;
+      const K &pivot = less(a, b) ? (less(b, c) ? b : (less(a, c) ? c : a))
+                                  : (less(a, c) ? a : (less(b, c) ? c : b));
+      K p = pivot;
+      K *lo = std::partition(t.from, t.to, [&](const K &k) { return less(k, p); });
+      K *hi = std::partition(lo, t.to, [&](const K &k) { return !less(p, k); });
+      if (hi < t.to) {
+        SortTask upper = t;
+        upper.from = hi;
+        t.pending->fetch_add(1);
+        sort_tasks.enqueue(upper);
+        work.signal();
+      }
+      t.to = lo;
+    }
+    sort_leaf(t.from, t.to, t.scratch ? t.scratch + (t.from - t.run) : nullptr);
+    if (t.pending->fetch_sub(1) == 1) {
+      t.finished->signal();
+    }
+  }
+
+  // Run one piece of another worker's sort, if any is waiting
+  bool help_sort() {
+    SortTask t;
+    if (!sort_tasks.try_dequeue(t)) {
+      return false;
+    }
+    run_sort_task(t);
+    return true;
+  }
+
+  // Sort a run, sharing the work with idle workers when it is large. The
+  // worker's radix buffer is used when the run fits in it.
+  void sort_run(K *from, K *to, IoScratch &io) {
+    ScopedTimer timer{counters.sort_ns};
+    counters.runs_sorted++;
+    // Presorted and reverse sorted batches cost one scan
+    if (std::is_sorted(from, to, C())) {
+      return;
+    }
+    if (std::is_sorted(from, to, [](const K &a, const K &b) { return C()(b, a); })) {
+      std::reverse(from, to);
+      return;
+    }
+    size_t n = std::distance(from, to);
+    K *scratch = n <= run_capacity ? io.sort_scratch : nullptr;
+    if (threads == 1 || n < parallel_sort_min) {
+      sort_leaf(from, to, scratch);
+      return;
+    }
+    std::atomic<size_t> pending{1};
+    moodycamel::LightweightSemaphore finished;
+    size_t grain = std::max<size_t>(n / (threads * 4), 1 << 13);
+    run_sort_task(SortTask{from, to, grain, from, scratch, &pending, &finished});
+    while (pending.load() > 0 && help_sort()) {
+    }
+    finished.wait();
+  }
+
+  // Sort one batch from push_queue and park it in the waitroom
+  bool sort_one_batch(IoScratch &io) {
+    // Counted from before the dequeue, so a drain never sees an empty
+    // queue while a batch taken from it is still being sorted
+    sorting++;
+    BatchEntry job;
+    if (!push_queue.try_dequeue(job)) {
+      done_sorting();
+      return false;
+    }
+    free_slots.signal();
+    if (replacement) {
+      {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        rs_pending.push(job);
+      }
+      done_sorting();
+      return true;
+    }
+    sort_batch(job, io);
+    park(job);
+    done_sorting();
+    work.signal();
+    return true;
+  }
+
+  void done_sorting() {
+    if (--sorting == 0 && draining.load()) {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      drained.notify_all();
+    }
+  }
+
+  // Wait for the running workers to sort every batch still queued
+  void drain_push_queue() {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    draining.store(true);
+    work.signal(threads);
+    drained.wait(lock, [this]() { return sorting.load() == 0 && push_queue.size_approx() == 0; });
+    draining.store(false);
+  }
+
+  // Sort a batch in place. With top_k, records ordered after the cutoff
+  // are dropped before sorting and only the first top_k are kept after;
+  // the budget for what was dropped is given back right away, as it is
+  // for records folded together by Reduce.
+  void sort_batch(BatchEntry &job, IoScratch &io) {
+    K *end = job.to;
+    if (hold_top) {
+      std::unique_lock<std::mutex> lock(state_mutex);
+      if (have_cutoff) {
+        K cut = cutoff;
+        lock.unlock();
+        end = std::partition(job.from, end, [&](const K &k) { return !C()(cut, k); });
+      }
+    }
+    sort_run(job.from, end, io);
+    if constexpr (reducing) {
+      end = collapse(job.from, end);
+    }
+    if (top_k > 0) {
+      end = job.from + std::min<size_t>(end - job.from, top_k);
+    }
+    if (end != job.to) {
+      memory.release(static_cast<long long>(job.to - end) * sizeof(K));
+      job.to = end;
+    }
+  }
+
+  // Put a sorted run in the waitroom. With hold_top it is merged with the
+  // run already waiting there instead, keeping the first top_k records of
+  // the two, so the waitroom holds at most one run per worker.
+  void park(BatchEntry run) {
+    while (hold_top) {
+      if (run.from == run.to) {
+        free_batch(run);
+        return;
+      }
+      BatchEntry other;
+      {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        if (waitroom.empty()) {
+          if (static_cast<size_t>(run.to - run.from) == top_k &&
+              (!have_cutoff || C()(*(run.to - 1), cutoff))) {
+            have_cutoff = true;
+            cutoff = *(run.to - 1);
+          }
+          waitroom.push(run);
+          return;
+        }
+        other = waitroom.front();
+        waitroom.pop();
+      }
+      run = merge_top(run, other);
+    }
+    std::lock_guard<std::mutex> lock(state_mutex);
+    waitroom.push(run);
+  }
+
+  // The first top_k records of two sorted runs as a new run. With
+  // hold_top that fits in a run slab from the pool, and its budget comes
+  // out of what the two inputs held.
+  BatchEntry merge_top(const BatchEntry &a, const BatchEntry &b) {
+    size_t held = (a.to - a.from) + (b.to - b.from);
+    K *out = allocate_run();
+    const K *x = a.from;
+    const K *y = b.from;
+    size_t n = 0;
+    while (x != a.to || y != b.to) {
+      const K &next = y == b.to || (x != a.to && !C()(*y, *x)) ? *x++ : *y++;
+      if constexpr (reducing) {
+        if (n > 0 && !C()(out[n - 1], next)) {
+          Reduce()(out[n - 1], next);
+          continue;
+        }
+      }
+      if (n == top_k) {
+        break;
+      }
+      out[n++] = next;
+    }
+    BatchEntry merged{out, out + n};
+    merged.heap_bytes = heap_bytes_of(out, out + n);
+    free_storage(a);
+    free_storage(b);
+    memory.release(static_cast<long long>((held - n) * sizeof(K) + a.heap_bytes + b.heap_bytes) -
+                   static_cast<long long>(merged.heap_bytes));
+    return merged;
+  }
+
+  std::string path_of(const Job &j) const { return spill_prefixes[j.dir] + j.filename(); }
+
+  // Spill directory for a new run merged from `inputs`. Directories on a
+  // device some input is read from are skipped unless nothing else is left.
+  int pick_dir(const std::vector<Job> &inputs) {
+    const int n = spill_dirs.size();
+    std::vector<bool> busy(n, false);
+    for (const Job &job : inputs) {
+      for (int d = 0; d < n; d++) {
+        busy[d] = busy[d] || spill_devices[d] == spill_devices[job.dir];
+      }
+    }
+    const int start = next_dir.fetch_add(1) % n;
+    int best = -1;
+    std::uintmax_t best_free = 0;
+    for (int k = 0; k < n; k++) {
+      int d = (start + k) % n;
+      if (busy[d]) {
+        continue;
+      }
+      if (spill_placement == SpillPlacement::round_robin) {
+        return d;
+      }
+      std::uintmax_t available = spill_free[d].load();
+      if (best < 0 || available > best_free) {
+        best = d;
+        best_free = available;
+      }
+    }
+    return best < 0 ? start : best;
+  }
+
+  // Refresh spill_free for the directory `name` was written to. Called
+  // after each run file is finished, never under state_mutex.
+  void note_free_space(const std::string &name) {
+    if (spill_placement != SpillPlacement::free_space) {
+      return;
+    }
+    for (size_t d = 0; d < spill_dirs.size(); d++) {
+      if (name.compare(0, spill_prefixes[d].size(), spill_prefixes[d]) == 0) {
+        std::error_code ec;
+        std::uintmax_t available = std::filesystem::space(spill_dirs[d], ec).available;
+        spill_free[d].store(ec ? 0 : available);
+        return;
+      }
+    }
+  }
+
+  // Call with state_mutex held, or once the workers are stopped
+  Job new_job(int level, const std::vector<Job> &inputs = {}) {
+    Job j{job_idx++, level};
+    j.dir = pick_dir(inputs);
+    bool known = !inputs.empty();
+    for (const Job &in : inputs) {
+      known = known && in.bounded;
+      j.records += in.records;
+    }
+    for (size_t i = 0; known && i < inputs.size(); i++) {
+      bound(j, &inputs[i].lo, &inputs[i].lo + 1);
+      bound(j, &inputs[i].hi, &inputs[i].hi + 1);
+    }
+    j.records = std::min(j.records, record_limit());
+    return j;
+  }
+
+  // Widen the bounds of `j` to cover the sorted range [from, to)
+  static void bound(Job &j, const K *from, const K *to) {
+    if (from == to) {
+      return;
+    }
+    if (!j.bounded) {
+      j.bounded = true;
+      j.lo = *from;
+      j.hi = *(to - 1);
+      return;
+    }
+    if (C()(*from, j.lo)) {
+      j.lo = *from;
+    }
+    if (C()(j.hi, *(to - 1))) {
+      j.hi = *(to - 1);
+    }
+  }
+
+  // Records [first, first + count) of a run file. A count running past the
+  // end of the file means the rest of it.
+  struct Slice {
+    std::string name;
+    size_t first;
+    size_t count;
+  };
+
+  static constexpr size_t to_end = std::numeric_limits<size_t>::max();
+
+  // Readers over a set of slices, and the streams behind them if any
+  template <class Source> struct SourceSet {
+    std::deque<std::ifstream> files;
+    std::deque<Source> readers;
+
+    bool open_file(const std::string &name) {
+      files.emplace_back(name, std::ios::binary);
+      if (!files.back()) {
+        std::cerr << "Failed to open file for reading: " << name << std::endl;
+        return false;
+      }
+      return true;
+    }
+  };
+
+  // Bytes a slice covers on disk. Framed runs are always read whole.
+  size_t slice_bytes(const Slice &slice) const {
+    if (!varlen && codec == Codec::none && slice.count != to_end) {
+      return slice.count * sizeof(K);
+    }
+    std::error_code ec;
+    size_t bytes = std::filesystem::file_size(slice.name, ec);
+    if (ec) {
+      return 0;
+    }
+    return varlen || codec != Codec::none ? bytes
+                                          : bytes - std::min(bytes, slice.first * sizeof(K));
+  }
+
+  // Open a source for every slice on the configured backend and hand the
+  // SourceSet to `fn` as a unique_ptr. Fails if any slice cannot be opened.
+  template <class Fn>
+  bool open_sources(const std::vector<Slice> &slices, IoScratch &io, Fn &&fn) {
+    for (const Slice &slice : slices) {
+      counters.bytes_read += slice_bytes(slice);
+    }
+    if constexpr (varlen) {
+      // Runs are only ever read whole, like compressed ones
+      auto set = std::make_unique<SourceSet<VarReader>>();
+      for (size_t i = 0; i < slices.size(); i++) {
+        if (!set->open_file(slices[i].name)) {
+          return false;
+        }
+        set->readers.emplace_back(set->files.back(), io.byte_block(i, 0),
+                                  io.byte_block(i, 1), io.stride_bytes, codec);
+      }
+      fn(std::move(set));
+      return true;
+    }
+    if (codec != Codec::none) {
+      // Frames cannot be seeked into by record, so compressed runs are
+      // always read whole
+      auto set = std::make_unique<SourceSet<PackedReader>>();
+      for (size_t i = 0; i < slices.size(); i++) {
+        if (!set->open_file(slices[i].name)) {
+          return false;
+        }
+        set->readers.emplace_back(set->files.back(), io.reader(i, 0),
+                                  reinterpret_cast<char *>(io.reader(i, 1)),
+                                  io.block, codec);
+      }
+      fn(std::move(set));
+      return true;
+    }
+    if (io.aio) {
+      auto set = std::make_unique<SourceSet<AsyncRunReader<K>>>();
+      for (size_t i = 0; i < slices.size(); i++) {
+        set->readers.emplace_back(*io.aio, slices[i].name, io.reader(i, 0),
+                                  io.reader(i, 1), io.block, slices[i].first,
+                                  slices[i].count, direct_io);
+        if (!set->readers.back().ok()) {
+          std::cerr << "Failed to open file for reading: " << slices[i].name
+                    << std::endl;
+          return false;
+        }
+      }
+      fn(std::move(set));
+      return true;
+    }
+#ifdef __linux__
+    if (mapped_io) {
+      auto set = std::make_unique<SourceSet<MappedRunReader<K>>>();
+      for (const Slice &slice : slices) {
+        set->readers.emplace_back(slice.name, io_block_bytes, slice.first, slice.count);
+        if (!set->readers.back().ok()) {
+          std::cerr << "Failed to map file for reading: " << slice.name
+                    << std::endl;
+          return false;
+        }
+      }
+      fn(std::move(set));
+      return true;
+    }
+#endif
+    auto set = std::make_unique<SourceSet<BatchedReader>>();
+    for (size_t i = 0; i < slices.size(); i++) {
+      if (!set->open_file(slices[i].name)) {
+        return false;
+      }
+      set->files.back().seekg(slices[i].first * sizeof(K));
+      set->readers.emplace_back(set->files.back(), io.reader(i), io.block,
+                                slices[i].count);
+    }
+    fn(std::move(set));
+    return true;
+  }
+
+  // Open sources for `slices` and hand them all to `fn` in one container.
+  // Fails if any slice cannot be opened or read.
+  template <class Fn>
+  bool with_sources(const std::vector<Slice> &slices, IoScratch &io, Fn &&fn) {
+    bool read = true;
+    bool opened = open_sources(slices, io, [&](auto set) {
+      fn(set->readers);
+      for (size_t i = 0; i < slices.size() && read; i++) {
+        if (!set->readers[i].ok()) {
+          std::cerr << "Failed to read file: " << slices[i].name << std::endl;
+          read = false;
+        }
+      }
+    });
+    return opened && read;
+  }
+
+  // Open a sink for `count` records from record `first` of `name` and hand
+  // it to `fn`. With `create` the file is created from scratch; otherwise it
+  // already has its final size and only the slice is written. At most
+  // `count` records reach the file; with Reduce equal neighbours are folded
+  // on the way and a created file is cut down to what was written. The
+  // count of a framed run is only a size estimate, so those are held to
+  // record_limit() instead. When Reduce or top_k can drop records,
+  // `records` is set to how many reached the file; otherwise it is left as
+  // the caller counted it.
+  template <class Fn>
+  bool with_sink(const std::string &name, size_t first, size_t count, bool create,
+                 IoScratch &io, size_t &records, Fn &&fn) {
+    const size_t limit = varlen || codec != Codec::none ? record_limit() : count;
+    size_t written = count;
+    bool may_drop = reducing || top_k > 0;
+    bool ok = write_sink(name, first, count, create, io, [&](auto &out) {
+      using Limited = LimitedSink<std::decay_t<decltype(out)>>;
+      if constexpr (reducing) {
+        Limited limited{out, limit};
+        ReducingSink<Limited> sink{limited};
+        fn(sink);
+        sink.flush();
+        written = limit - limited.left;
+      } else if (top_k > 0) {
+        Limited sink{out, limit};
+        fn(sink);
+        written = limit - sink.left;
+      } else {
+        fn(out);
+      }
+    });
+    if (!ok) {
+      return false;
+    }
+    if (varlen || codec != Codec::none) {
+      std::error_code ec;
+      auto bytes = std::filesystem::file_size(name, ec);
+      counters.bytes_spilled += ec ? 0 : bytes;
+    } else {
+      if (create && written < count) {
+        std::filesystem::resize_file(name, written * sizeof(K));
+      }
+      counters.bytes_spilled += written * sizeof(K);
+    }
+    if (may_drop) {
+      records = written;
+    }
+    note_free_space(name);
+    return true;
+  }
+
+  template <class Fn>
+  bool write_sink(const std::string &name, size_t first, size_t count, bool create,
+                  IoScratch &io, Fn &&fn) {
+    if constexpr (varlen) {
+      std::ofstream of{name, std::ios::binary};
+      if (!of) {
+        std::cerr << "Failed to open file for writing: " << name << std::endl;
+        return false;
+      }
+      VarWriter writer(of, io.byte_block(fan_in, 0), io.byte_block(fan_in, 1),
+                       io.stride_bytes, codec, codec_level);
+      fn(writer);
+      writer.flush();
+      if (!of) {
+        std::cerr << "Failed to write file: " << name << std::endl;
+        return false;
+      }
+      return true;
+    }
+    if (codec != Codec::none) {
+      std::ofstream of{name, std::ios::binary};
+      if (!of) {
+        std::cerr << "Failed to open file for writing: " << name << std::endl;
+        return false;
+      }
+      PackedWriter writer(of, io.writer(0), reinterpret_cast<char *>(io.writer(1)),
+                          io.block, codec, codec_level);
+      fn(writer);
+      writer.flush();
+      if (!of) {
+        std::cerr << "Failed to write file: " << name << std::endl;
+        return false;
+      }
+      return true;
+    }
+    if (io.aio) {
+      AsyncRunWriter<K> out(*io.aio, name, io.writer(0), io.writer(1), io.block,
+                            first, create, direct_io);
+      if (!out.ok()) {
+        std::cerr << "Failed to open file for writing: " << name << std::endl;
+        return false;
+      }
+      fn(out);
+      out.flush();
+      if (!out.ok()) {
+        std::cerr << "Failed to write file: " << name << std::endl;
+        return false;
+      }
+      return true;
+    }
+#ifdef __linux__
+    if (mapped_io) {
+      MappedRunWriter<K> out(name, first + count, create);
+      if (!out.ok()) {
+        std::cerr << "Failed to map file for writing: " << name << std::endl;
+        return false;
+      }
+      auto sink = out.slice(first, io_block_bytes);
+      fn(sink);
+      return true;
+    }
+#endif
+    std::ofstream of;
+    if (create) {
+      of.open(name, std::ios::binary);
+    } else {
+      // in | out keeps the sized file instead of truncating it
+      of.open(name, std::ios::binary | std::ios::in | std::ios::out);
+    }
+    if (!of) {
+      std::cerr << "Failed to open file for writing: " << name << std::endl;
+      return false;
+    }
+    of.seekp(first * sizeof(K));
+    BatchedWriter writer(of, io.writer(), io.block);
+    fn(writer);
+    writer.flush();
+    if (!of) {
+      std::cerr << "Failed to write file: " << name << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Merge two sorted batches into the file for `j`, and count what it kept
+  bool write_pair(Job &j, BatchEntry b1, BatchEntry b2, IoScratch &io) {
+    size_t count = std::min<size_t>((b1.to - b1.from) + (b2.to - b2.from), record_limit());
+    // Batches that don't overlap go out one after the other
+    if (b1.from != b1.to && b2.from != b2.to && C()(*b2.from, *(b1.to - 1)) &&
+        !C()(*b1.from, *(b2.to - 1))) {
+      std::swap(b1, b2);
+    }
+    bool chained = b1.from == b1.to || b2.from == b2.to ||
+                   !C()(*b2.from, *(b1.to - 1));
+    return with_sink(path_of(j), 0, count, true, io, j.records, [&](auto &sink) {
+      if (chained) {
+        sink.write_all(b1.from, b1.to);
+        sink.write_all(b2.from, b2.to);
+      } else {
+        merge_to_file(sink, b1.from, b1.to, b2.from, b2.to);
+      }
+    });
+  }
+
+  // Most records a run may hold, which is top_k when set
+  size_t record_limit() const { return top_k > 0 ? top_k : to_end; }
+
+  // Passes the first `left` records written to it on to `out`
+  template <class Sink> struct LimitedSink {
+    Sink &out;
+    size_t left;
+
+    void write(const K &item) {
+      if (left > 0) {
+        left--;
+        out.write(item);
+      }
+    }
+
+    void write_all(const K *from, const K *to) {
+      size_t n = std::min<size_t>(left, to - from);
+      out.write_all(from, from + n);
+      left -= n;
+    }
+
+    void flush() { out.flush(); }
+  };
+
+  // Folds each run of equal records written to it into one with Reduce
+  // before passing it on to `out`
+  template <class Sink> struct ReducingSink {
+    Sink &out;
+    K pending{};
+    bool held = false;
+
+    void write(const K &item) {
+      if (held && !C()(pending, item)) {
+        Reduce()(pending, item);
+        return;
+      }
+      if (held) {
+        out.write(pending);
+      }
+      pending = item;
+      held = true;
+    }
+
+    void write_all(const K *from, const K *to) {
+      for (; from != to; from++) {
+        write(*from);
+      }
+    }
+
+    void flush() {
+      if (held) {
+        out.write(pending);
+        held = false;
+      }
+      out.flush();
+    }
+  };
+
+  // Fold each run of equal records in the sorted range [from, to) into its
+  // first; returns the new end
+  static K *collapse(K *from, K *to) {
+    if (from == to) {
+      return to;
+    }
+    K *last = from;
+    for (K *it = from + 1; it != to; it++) {
+      if (C()(*last, *it)) {
+        *++last = std::move(*it);
+      } else {
+        Reduce()(*last, *it);
+      }
+    }
+    return last + 1;
+  }
+
+  // Write one sorted batch to the file for `j`, and count what it kept
+  bool spill_batch(Job &j, const BatchEntry &b, IoScratch &io) {
+    return with_sink(path_of(j), 0, b.to - b.from, true, io, j.records,
+                     [&](auto &sink) { sink.write_all(b.from, b.to); });
+  }
+
+  // A record in the replacement selection heap, tagged with its run
+  struct Tagged {
+    unsigned run;
+    K rec;
+  };
+
+  // Heap order: std heaps put the greatest first, so the greatest here is
+  // the earliest run's smallest record
+  struct TaggedAfter {
+    bool operator()(const Tagged &a, const Tagged &b) const {
+      if (a.run != b.run) {
+        return a.run > b.run;
+      }
+      return C()(b.rec, a.rec);
+    }
+  };
+
+  // Append sorted records to the end of a run file in its on-disk format;
+  // compressed frames concatenate, so both formats grow by appending
+  bool append_to_run(const std::string &name, const K *from, const K *to,
+                     bool fresh) {
+    std::ofstream of{name, fresh ? std::ios::binary : std::ios::binary | std::ios::app};
+    if (!of) {
+      std::cerr << "Failed to open file for writing: " << name << std::endl;
+      return false;
+    }
+    of.seekp(0, std::ios::end);
+    std::streamoff start = of.tellp();
+    if constexpr (varlen) {
+      VarWriter writer(of, rs_bytes.data(), rs_packed.data(), rs_bytes.size(), codec,
+                       codec_level);
+      writer.write_all(from, to);
+      writer.flush();
+    } else if (codec != Codec::none) {
+      PackedWriter writer(of, nullptr, rs_packed.data(), rs_block.size(), codec,
+                          codec_level);
+      writer.write_all(from, to);
+    } else {
+      of.write(reinterpret_cast<const char *>(from), std::distance(from, to) * sizeof(K));
+    }
+    if (!of) {
+      std::cerr << "Failed to write file: " << name << std::endl;
+      return false;
+    }
+    counters.bytes_spilled += of.tellp() - start;
+    return true;
+  }
+
+  void flush_rs_block() {
+    if (rs_fill > 0) {
+      append_to_run(path_of(rs_job), rs_block.data(), rs_block.data() + rs_fill,
+                    rs_fresh);
+      rs_fresh = false;
+      rs_fill = 0;
+    }
+  }
+
+  // Close the run being written and hand it to the mergers
+  void close_rs_run() {
+    flush_rs_block();
+    note_free_space(path_of(rs_job));
+    rs_job.hi = rs_last;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      publish(rs_job);
+    }
+    save_checkpoint();
+    rs_open = false;
+    work.signal();
+  }
+
+  // Write the heap top out to its run, starting a new run when its tag
+  // moves past the open one. The heap bytes of the record were pinned
+  // when it came in from its batch and are given back here.
+  void emit_rs_top() {
+    std::pop_heap(rs_heap.begin(), rs_heap.end(), TaggedAfter());
+    const Tagged &out = rs_heap.back();
+    if constexpr (varlen) {
+      long long bytes = static_cast<long long>(Serial<K>::size(out.rec));
+      memory.unpin(bytes);
+      memory.release(bytes);
+    }
+    if (rs_open && out.run != rs_run) {
+      close_rs_run();
+    }
+    if (!rs_open) {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      rs_job = new_job(0);
+      rs_job.bounded = true;
+      rs_job.lo = out.rec;
+      rs_run = out.run;
+      rs_open = rs_fresh = true;
+      spilled.store(true);
+    }
+    if constexpr (reducing) {
+      // Fold into the record before it, still in the block
+      if (rs_fill > 0 && !C()(rs_last, out.rec)) {
+        Reduce()(rs_block[rs_fill - 1], out.rec);
+        return;
+      }
+    }
+    // A full block goes out only once a record that can't fold into its
+    // last one shows up; close_rs_run() writes what is left
+    if (rs_fill == rs_block.size()) {
+      flush_rs_block();
+    }
+    rs_block[rs_fill++] = out.rec;
+    rs_job.records++;
+    rs_last = out.rec;
+  }
+
+  // Push one batch through the heap. A record smaller than the last one
+  // written can't join the open run, so it is tagged for the next.
+  void feed_rs(const BatchEntry &b) {
+    ScopedTimer timer{counters.sort_ns};
+    for (const K *rec = b.from; rec != b.to; rec++) {
+      if (rs_heap.size() == rs_capacity) {
+        emit_rs_top();
+        rs_heap.pop_back();
+      }
+      unsigned run = rs_open && C()(*rec, rs_last) ? rs_run + 1 : rs_run;
+      rs_heap.push_back(Tagged{run, *rec});
+      std::push_heap(rs_heap.begin(), rs_heap.end(), TaggedAfter());
+    }
+  }
+
+  // Worker step: feed pending batches through the heap, one worker at a
+  // time since the heap is strictly sequential
+  bool run_replacement() {
+    std::unique_lock<std::mutex> rs_lock(rs_mutex, std::try_to_lock);
+    if (!rs_lock.owns_lock()) {
+      return false;
+    }
+    bool worked = false;
+    while (true) {
+      BatchEntry b;
+      {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        if (rs_pending.empty()) {
+          return worked;
+        }
+        b = rs_pending.front();
+        rs_pending.pop();
+      }
+      // The records now live in the heap, which only gives them up as
+      // more come in, so their heap bytes stay pinned there
+      memory.pin(static_cast<long long>(b.heap_bytes));
+      feed_rs(b);
+      b.heap_bytes = 0;
+      free_batch(b);
+      worked = true;
+    }
+  }
+
+  // Empty the heap into its remaining runs
+  void drain_replacement() {
+    run_replacement();
+    while (!rs_heap.empty()) {
+      emit_rs_top();
+      rs_heap.pop_back();
+    }
+    if (rs_open) {
+      close_rs_run();
+    }
+  }
+
+  // Merge two sorted waitroom entries into a level 0 file. With
+  // in_memory this waits until the budget is first exhausted.
+  bool merge_waitroom_pair(IoScratch &io) {
+    // A held top_k run is already within budget and never spills
+    if (hold_top) {
+      return false;
+    }
+    if (in_memory && !spilled.load()) {
+      if (!memory.under_pressure()) {
+        return false;
+      }
+      spilled.store(true);
+    }
+    std::unique_lock<std::mutex> lock(state_mutex);
+    if (waitroom.size() < 2) {
+      return false;
+    }
+    BatchEntry b1 = waitroom.front();
+    waitroom.pop();
+    BatchEntry b2 = waitroom.front();
+    waitroom.pop();
+    Job j = new_job(0);
+    bound(j, b1.from, b1.to);
+    bound(j, b2.from, b2.to);
+    j.records = std::min<size_t>((b1.to - b1.from) + (b2.to - b2.from), record_limit());
+    lock.unlock();
+
+    bool written;
+    {
+      ScopedTimer timer{counters.merge_ns};
+      written = write_pair(j, b1, b2, io);
+    }
+    if (!written) {
+      lock.lock();
+      waitroom.push(b1);
+      waitroom.push(b2);
+      return false;
+    }
+    counters.merged(0);
+    free_batch(b1);
+    free_batch(b2);
+    lock.lock();
+    publish(j);
+    lock.unlock();
+    save_checkpoint();
+    work.signal();
+    return true;
+  }
+
+  // Spill a lone waitroom entry when producers are blocked on the budget,
+  // since it would otherwise wait for a partner that cannot be allocated
+  bool spill_under_pressure(IoScratch &io) {
+    if (hold_top || !memory.under_pressure()) {
+      return false;
+    }
+    std::unique_lock<std::mutex> lock(state_mutex);
+    if (waitroom.size() != 1) {
+      return false;
+    }
+    spilled.store(true);
+    BatchEntry b = waitroom.front();
+    waitroom.pop();
+    Job j = new_job(0);
+    bound(j, b.from, b.to);
+    j.records = b.to - b.from;
+    lock.unlock();
+
+    if (!spill_batch(j, b, io)) {
+      lock.lock();
+      waitroom.push(b);
+      return false;
+    }
+    free_batch(b);
+    lock.lock();
+    publish(j);
+    lock.unlock();
+    save_checkpoint();
+    work.signal();
+    return true;
+  }
+
+  // Add a finished run to JQ and checkpoint it. Call with state_mutex held,
+  // then save_checkpoint() once it is released.
+  void publish(const Job &j) {
+    JQ.insert(j);
+    checkpoint();
+  }
+
+  // Note that `group` left JQ to be merged. Call with state_mutex held.
+  void claim(const std::vector<Job> &group) {
+    merging.insert(merging.end(), group.begin(), group.end());
+  }
+
+  // End the merge of `group`: publish `merged`, or put `group` back in JQ if
+  // it is null. Call with state_mutex held; once it is released,
+  // save_checkpoint() and then remove_runs(group) if the merge went through.
+  void settle(const std::vector<Job> &group, const Job *merged) {
+    merging.erase(std::remove_if(merging.begin(), merging.end(),
+                                 [&](const Job &m) {
+                                   for (const Job &job : group) {
+                                     if (job.id == m.id) {
+                                       return true;
+                                     }
+                                   }
+                                   return false;
+                                 }),
+                  merging.end());
+    if (merged != nullptr) {
+      publish(*merged);
+    } else {
+      JQ.insert(group.begin(), group.end());
+    }
+  }
+
+  void remove_runs(const std::vector<Job> &group) {
+    for (const Job &job : group) {
+      std::filesystem::remove(path_of(job));
+    }
+  }
+
+  // Checkpoint manifest: a header, then each run with its bounds in the
+  // run format, raw bytes or Serial<K> led by its length
+  static constexpr uint32_t manifest_magic = 0x4f324d46;
+  struct ManifestHeader {
+    uint32_t magic;
+    uint32_t record_bytes;
+    uint32_t codec;
+    uint32_t dirs;
+    uint32_t complete;
+    int32_t job_idx;
+    uint64_t runs;
+  };
+  struct ManifestRun {
+    int32_t id;
+    int32_t level;
+    int32_t dir;
+    uint32_t bounded;
+    uint64_t records;
+  };
+
+  std::string manifest_path() const { return spill_dirs[0] + "/manifest"; }
+
+  template <class T> static void append_bytes(std::string &out, const T &v) {
+    out.append(reinterpret_cast<const char *>(&v), sizeof(T));
+  }
+
+  static void write_bound(std::string &out, const K &k) {
+    if constexpr (varlen) {
+      std::vector<char> bytes(Serial<K>::size(k));
+      Serial<K>::write(k, bytes.data());
+      append_bytes(out, static_cast<uint32_t>(bytes.size()));
+      out.append(bytes.data(), bytes.size());
+    } else {
+      append_bytes(out, k);
+    }
+  }
+
+  static bool read_bound(std::ifstream &in, K &k) {
+    if constexpr (varlen) {
+      uint32_t len;
+      if (!in.read(reinterpret_cast<char *>(&len), sizeof(len))) {
+        return false;
+      }
+      std::vector<char> bytes(len);
+      if (!in.read(bytes.data(), len)) {
+        return false;
+      }
+      return Serial<K>::read(k, bytes.data(), bytes.data() + len) ==
+             bytes.data() + len;
+    } else {
+      return read_item(in, k);
+    }
+  }
+
+  // Snapshot the manifest of JQ and the runs being merged for
+  // save_checkpoint() to write. Call with state_mutex held.
+  void checkpoint() {
+    if (!checkpointing) {
+      return;
+    }
+    std::vector<Job> runs(JQ.begin(), JQ.end());
+    runs.insert(runs.end(), merging.begin(), merging.end());
+    std::string bytes;
+    append_bytes(bytes, ManifestHeader{manifest_magic, sizeof(K),
+                                       static_cast<uint32_t>(codec),
+                                       static_cast<uint32_t>(spill_dirs.size()),
+                                       input_complete, job_idx, runs.size()});
+    for (const Job &job : runs) {
+      append_bytes(bytes, ManifestRun{job.id, job.level, job.dir, job.bounded, job.records});
+      if (job.bounded) {
+        write_bound(bytes, job.lo);
+        write_bound(bytes, job.hi);
+      }
+    }
+    manifest_pending.swap(bytes);
+    manifest_seq++;
+  }
+
+  // Write the newest snapshot, if no other thread has taken it, to a file
+  // of its own and rename it over the manifest unless a newer one got
+  // there first. Returns once every snapshot up to the caller's is down,
+  // so runs it no longer lists can go. Call without state_mutex held.
+  void save_checkpoint() {
+    if (!checkpointing) {
+      return;
+    }
+    std::string bytes;
+    uint64_t seq = 0;
+    uint64_t need;
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      need = manifest_seq;
+      if (!manifest_pending.empty()) {
+        bytes.swap(manifest_pending);
+        seq = manifest_seq;
+      }
+    }
+    std::unique_lock<std::mutex> lock(manifest_mutex, std::defer_lock);
+    if (seq > 0) {
+      std::string name = manifest_path();
+      std::string staged = name + "." + std::to_string(seq) + ".new";
+      std::ofstream out{staged, std::ios::binary};
+      out.write(bytes.data(), bytes.size());
+      out.close();
+      bool written = static_cast<bool>(out);
+      lock.lock();
+      std::error_code ec;
+      if (written && seq > manifest_saved) {
+        std::filesystem::rename(staged, name, ec);
+      } else {
+        std::filesystem::remove(staged, ec);
+      }
+      if (!written || ec) {
+        std::cerr << "Failed to write checkpoint: " << name << std::endl;
+      }
+      // A failed write is reported, not retried, so waiters go on
+      manifest_saved = std::max(manifest_saved, seq);
+      manifest_stored.notify_all();
+    } else {
+      lock.lock();
+    }
+    manifest_stored.wait(lock, [&]() { return manifest_saved >= need; });
+  }
+
+  // The output is the caller's from here on, so stop checkpointing and
+  // drop the manifest before a later sorter takes the output for runs
+  void retire_checkpoint() {
+    if (!checkpointing) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(manifest_mutex);
+    checkpointing = false;
+    std::error_code ec;
+    std::filesystem::remove(manifest_path(), ec);
+  }
+
+  // Pick up the runs in a manifest left by an earlier sorter. If its input
+  // wasn't all spilled, or a run is missing, the runs are of no use and go.
+  void resume() {
+    std::string name = manifest_path();
+    std::ifstream in{name, std::ios::binary};
+    if (!in) {
+      return;
+    }
+    ManifestHeader h;
+    std::vector<Job> runs;
+    bool ok = static_cast<bool>(in.read(reinterpret_cast<char *>(&h), sizeof(h))) &&
+              h.magic == manifest_magic && h.record_bytes == sizeof(K) &&
+              h.codec == static_cast<uint32_t>(codec) && h.dirs == spill_dirs.size();
+    for (uint64_t i = 0; ok && i < h.runs; i++) {
+      ManifestRun r;
+      ok = static_cast<bool>(in.read(reinterpret_cast<char *>(&r), sizeof(r))) &&
+           r.dir >= 0 && r.dir < static_cast<int>(spill_dirs.size());
+      if (!ok) {
+        break;
+      }
+      Job job{r.id, r.level, r.dir};
+      job.bounded = r.bounded;
+      job.records = r.records;
+      ok = !job.bounded || (read_bound(in, job.lo) && read_bound(in, job.hi));
+      runs.push_back(job);
+    }
+    in.close();
+    bool usable = ok && h.complete;
+    for (const Job &job : runs) {
+      usable = usable && std::filesystem::exists(path_of(job));
+    }
+    // Run files it doesn't list, like the output of a merge that was in
+    // flight, and unsaved snapshots are left over from the dead sorter
+    std::set<std::string> listed;
+    for (const Job &job : runs) {
+      listed.insert(path_of(job));
+    }
+    for (size_t d = 0; d < spill_dirs.size(); d++) {
+      std::error_code ec;
+      for (const auto &entry : std::filesystem::directory_iterator(spill_dirs[d], ec)) {
+        std::string file = entry.path().filename().string();
+        std::string path = spill_dirs[d] + "/" + file;
+        bool run = file.size() > 5 && file[0] == 'B' &&
+                   file.compare(file.size() - 4, 4, ".tmp") == 0;
+        bool snapshot = d == 0 && file.compare(0, 9, "manifest.") == 0;
+        if ((run && (!usable || !listed.count(path))) || snapshot) {
+          std::filesystem::remove(path, ec);
+        }
+      }
+    }
+    if (!usable) {
+      std::filesystem::remove(name);
+      return;
+    }
+    fprintf(stderr, "Resuming %zu runs from %s\n", runs.size(), name.c_str());
+    JQ.insert(runs.begin(), runs.end());
+    job_idx = h.job_idx;
+    input_complete = was_resumed = true;
+    spilled.store(true);
+  }
+
+  // Records in a run file, or false if its size cannot be read
+  static bool run_records(const std::string &name, size_t &count) {
+    std::error_code ec;
+    auto bytes = std::filesystem::file_size(name, ec);
+    if (ec) {
+      std::cerr << "Failed to open file for reading: " << name << std::endl;
+      return false;
+    }
+    count = bytes / sizeof(K);
+    return true;
+  }
+
+  // Put `chain` in key order if its runs' ranges don't overlap, so that
+  // each one ends no later than the next one starts
+  static bool chain_order(std::vector<Job> &chain) {
+    for (const Job &job : chain) {
+      if (!job.bounded) {
+        return false;
+      }
+    }
+    std::sort(chain.begin(), chain.end(),
+              [](const Job &a, const Job &b) { return C()(a.lo, b.lo); });
+    for (size_t i = 1; i < chain.size(); i++) {
+      // Equal records on either side of a seam would never be folded
+      if (C()(chain[i].lo, chain[i - 1].hi) ||
+          (reducing && !C()(chain[i - 1].hi, chain[i].lo))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Copy all of `name` onto the end of `out`, inside the kernel if it can
+  static bool append_file(int out, const std::string &name) {
+    int in = open(name.c_str(), O_RDONLY);
+    if (in < 0) {
+      return false;
+    }
+    bool ok = true;
+    bool eof = false;
+#ifdef __linux__
+    ssize_t n;
+    while ((n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0) {
+    }
+    eof = n == 0;
+#endif
+    // Fall back to copying by hand from wherever the kernel left off
+    char buf[1 << 16];
+    while (!eof && ok) {
+      ssize_t got = read(in, buf, sizeof(buf));
+      if (got <= 0) {
+        ok = got == 0;
+        break;
+      }
+      for (ssize_t off = 0; off < got && ok;) {
+        ssize_t w = write(out, buf + off, got - off);
+        ok = w > 0;
+        off += w;
+      }
+    }
+    close(in);
+    return ok;
+  }
+
+  // Runs in `chain` follow each other in key order, so `merged` is their
+  // files back to back; compressed frames concatenate just as well
+  bool concat_jobs(const std::vector<Job> &chain, const Job &merged) {
+    std::string out_name = path_of(merged);
+    int out = open(out_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+      std::cerr << "Failed to open file for writing: " << out_name << std::endl;
+      return false;
+    }
+    bool ok = true;
+    for (const Job &job : chain) {
+      std::error_code ec;
+      auto bytes = std::filesystem::file_size(path_of(job), ec);
+      ok = ok && append_file(out, path_of(job));
+      if (ok && !ec) {
+        counters.bytes_read += bytes;
+        counters.bytes_spilled += bytes;
+      }
+    }
+    ok = close(out) == 0 && ok;
+    if (!ok) {
+      std::cerr << "Failed to write file: " << out_name << std::endl;
+      std::filesystem::remove(out_name);
+      return false;
+    }
+    note_free_space(out_name);
+    return true;
+  }
+
+  // Merge finished files into `merged`, and count what it kept. The inputs
+  // are left for the caller to remove once `merged` is published.
+  bool merge_jobs(const std::vector<Job> &group, Job &merged,
+                  IoScratch &io) {
+    std::vector<Job> chain = group;
+    size_t held = 0;
+    for (const Job &job : group) {
+      held += job.records;
+    }
+    // Concatenating would keep records past top_k
+    if (held <= record_limit() && chain_order(chain)) {
+      return concat_jobs(chain, merged);
+    }
+    std::vector<Slice> slices;
+    size_t total = 0;
+    for (const Job &job : group) {
+      Slice slice{path_of(job), 0, 0};
+      if (!run_records(slice.name, slice.count)) {
+        return false;
+      }
+      total += slice.count;
+      slices.push_back(slice);
+    }
+    bool written = false;
+    bool ok = with_sources(slices, io, [&](auto &sources) {
+      written = with_sink(path_of(merged), 0, std::min(total, record_limit()), true, io,
+                          merged.records, [&](auto &sink) {
+                            // Folding can leave fewer records than were read,
+                            // so the sink does the counting then
+                            merge_sources(sources, sink, reducing ? to_end : record_limit());
+                          });
+    });
+    return ok && written;
+  }
+
+  // Merge finished files into `merged` on every worker's scratch at once.
+  // Splitters sampled from the runs cut each run into `threads` key ranges
+  // by binary search; worker p merges range p into its own slice of the
+  // output, which starts where the earlier ranges end.
+  bool merge_jobs_partitioned(const std::vector<Job> &group, Job &merged) {
+    std::vector<Job> chain = group;
+    if (chain_order(chain)) {
+      return concat_jobs(chain, merged);
+    }
+    const int parts = threads;
+    std::vector<std::string> names;
+    std::vector<size_t> counts;
+    std::vector<K> samples;
+    const size_t samples_per_run = 32 * parts;
+    for (const Job &job : group) {
+      names.push_back(path_of(job));
+      counts.emplace_back();
+      if (!run_records(names.back(), counts.back())) {
+        return false;
+      }
+      std::ifstream in{names.back(), std::ios::binary};
+      size_t n = std::min(samples_per_run, counts.back());
+      for (size_t j = 0; j < n; j++) {
+        samples.push_back(read_at(in, j * counts.back() / n));
+      }
+    }
+    if (samples.empty()) {
+      return merge_jobs(group, merged, *scratch[0]);
+    }
+    std::sort(samples.begin(), samples.end(), C());
+
+    // cuts[r][p] is where range p starts in run r
+    std::vector<std::vector<size_t>> cuts(group.size(), std::vector<size_t>(parts + 1));
+    for (size_t r = 0; r < group.size(); r++) {
+      std::ifstream in{names[r], std::ios::binary};
+      cuts[r][0] = 0;
+      for (int p = 1; p < parts; p++) {
+        const K &splitter = samples[p * samples.size() / parts];
+        cuts[r][p] = lower_bound_in_file(in, counts[r], splitter);
       }
-      return level < other.level;
+      cuts[r][parts] = counts[r];
     }
-    std::string filename() const {
-      return std::to_string(id) + "_" + std::to_string(level) + ".tmp";
+    std::vector<size_t> offsets(parts + 1, 0);
+    for (int p = 1; p <= parts; p++) {
+      offsets[p] = offsets[p - 1];
+      for (size_t r = 0; r < group.size(); r++) {
+        offsets[p] += cuts[r][p] - cuts[r][p - 1];
+      }
     }
-  };
 
-  // Helper function to read a single item from a binary stream
-  static bool read_item(std::ifstream &in, K &item) {
-    return static_cast<bool>(in.read(reinterpret_cast<char *>(&item), sizeof(K)));
-  }
+    std::string out_name = path_of(merged);
+    {
+      int fd = open(out_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd < 0) {
+        std::cerr << "Failed to open file for writing: " << out_name << std::endl;
+        return false;
+      }
+      bool sized = reserve_file(fd, offsets[parts] * sizeof(K));
+      close(fd);
+      if (!sized) {
+        std::cerr << "Failed to write file: " << out_name << std::endl;
+        std::filesystem::remove(out_name);
+        return false;
+      }
+    }
 
-  // Helper function to write a single item to a binary stream
-  static void write_item(std::ofstream &out, const K &item) {
-    out.write(reinterpret_cast<const char *>(&item), sizeof(K));
+    std::atomic<bool> ok{true};
+    std::vector<std::thread> pool;
+    for (int p = 0; p < parts; p++) {
+      pool.emplace_back([&, p]() {
+        IoScratch &io = *scratch[p];
+        std::vector<Slice> slices;
+        for (size_t r = 0; r < group.size(); r++) {
+          slices.push_back(Slice{names[r], cuts[r][p], cuts[r][p + 1] - cuts[r][p]});
+        }
+        bool written = false;
+        // Nothing is folded or cut here, so every slice comes out whole
+        size_t kept = offsets[p + 1] - offsets[p];
+        bool read = with_sources(slices, io, [&](auto &sources) {
+          written = with_sink(out_name, offsets[p], kept, false, io, kept,
+                              [&](auto &sink) { merge_sources(sources, sink); });
+        });
+        if (!read || !written) {
+          ok.store(false);
+        }
+      });
+    }
+    for (auto &t : pool) {
+      t.join();
+    }
+    if (!ok.load()) {
+      std::cerr << "Failed to write merged file: " << out_name << std::endl;
+      return false;
+    }
+    return true;
   }
 
-  // Batched reader for efficient file reading
-  struct BatchedReader {
-    std::ifstream &file;
-    K *buffer;
-    size_t buffer_size;
-    size_t pos;
-    size_t count;
-    bool exhausted;
+  // Claim the fan_in smallest finished runs that are within a factor of two
+  // of each other and merge them. Runs under run_capacity count as full
+  // ones. Merging a big run with fresh small ones would rewrite the big
+  // one over and over, so such a group waits for more runs of its size.
+  // Runs being merged by other workers are out of JQ, so claims never
+  // overlap.
+  bool merge_level_group(IoScratch &io) {
+    std::unique_lock<std::mutex> lock(state_mutex);
+    if (JQ.size() < static_cast<size_t>(fan_in)) {
+      return false;
+    }
+    auto size_class = [this](const Job &j) { return std::max(j.records, run_capacity); };
+    auto first = JQ.begin();
+    auto last = std::next(first, fan_in - 1);
+    while (size_class(*last) >= 2 * size_class(*first)) {
+      if (++last == JQ.end()) {
+        return false;
+      }
+      ++first;
+    }
+    std::vector<Job> group(first, std::next(last));
+    int level = 0;
+    for (const Job &job : group) {
+      level = std::max(level, job.level);
+    }
+    Job merged = new_job(level + 1, group);
+    JQ.erase(first, std::next(last));
+    claim(group);
+    lock.unlock();
 
-    BatchedReader(std::ifstream &f, K *buf, size_t buf_size)
-        : file(f), buffer(buf), buffer_size(buf_size), pos(0), count(0), exhausted(false) {
-      refill();
+    bool ok;
+    {
+      ScopedTimer timer{counters.merge_ns};
+      ok = merge_jobs(group, merged, io);
     }
+    lock.lock();
+    if (!ok) {
+      // Re-insert jobs since we couldn't merge
+      settle(group, nullptr);
+      return false;
+    }
+    counters.merged(merged.level);
+    settle(group, &merged);
+    lock.unlock();
+    save_checkpoint();
+    remove_runs(group);
+    work.signal();
+    return true;
+  }
 
-    void refill() {
-      if (exhausted) return;
-      file.read(reinterpret_cast<char *>(buffer), buffer_size * sizeof(K));
-      size_t bytes_read = file.gcount();
-      count = bytes_read / sizeof(K);
-      pos = 0;
-      if (count == 0) {
-        exhausted = true;
+  // Worker loop: one of `threads` running concurrently. Idle workers sleep
+  // on `work`, which is signalled whenever a batch, run or memory waiter
+  // shows up.
+  void manage_sorting(IoScratch &io) {
+    while (!done.load()) {
+      bool worked = help_sort();
+      worked |= sort_one_batch(io);
+      worked |= replacement && run_replacement();
+      worked |= merge_waitroom_pair(io);
+      worked |= spill_under_pressure(io);
+      worked |= merge_level_group(io);
+      if (!worked) {
+        work.wait();
+      }
+    }
+  }
+  // Stop the workers and spill whatever is still in memory as level 0 runs
+  void spill_remaining() {
+    // Already done by an earlier sample(), finish() or stream()
+    if (done.load()) {
+      return;
+    }
+    if (int handles = live_producers.load()) {
+      std::cerr << "Producer handles still open at finish(): " << handles
+                << "; records they hold or push from now on are lost" << std::endl;
+    }
+    flush_open_run();
+    // Every worker sorts the last batches, and merges while at it; only
+    // then are they stopped
+    drain_push_queue();
+    stop_workers();
+    // Empty Waitrom. Workers are stopped; state_mutex is held around
+    // changes to waitroom and JQ for stats() callers.
+    BatchEntry job;
+    while (push_queue.try_dequeue(job)) {
+      free_slots.signal();
+      if (replacement) {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        rs_pending.push(job);
+        continue;
+      }
+      sort_batch(job, *scratch[0]);
+      park(job);
+    }
+    if (replacement) {
+      drain_replacement();
+    }
+    std::unique_lock<std::mutex> lock(state_mutex);
+    if ((in_memory || hold_top) && JQ.empty()) {
+      // Everything fit: keep the runs for execute() or stream()
+      while (!waitroom.empty()) {
+        resident.push_back(waitroom.front());
+        waitroom.pop();
       }
+      return;
+    }
+    while (waitroom.size() > 0) {
+      BatchEntry b = waitroom.front();
+      waitroom.pop();
+      Job j = new_job(0);
+      bound(j, b.from, b.to);
+      j.records = b.to - b.from;
+      lock.unlock();
+      bool written = spill_batch(j, b, *scratch[0]);
+      lock.lock();
+      if (!written) {
+        continue;
+      }
+      publish(j);
+      free_batch(b);
     }
+    input_complete = true;
+    checkpoint();
+    lock.unlock();
+    save_checkpoint();
+  }
 
-    bool has_more() const { return !exhausted; }
+  // Merge finished runs until at most `keep` are left, smallest first, on
+  // every worker's scratch at once. Each merge is sized so that only the
+  // first one runs below full fan-in. The one that leaves a single run
+  // waits for all others and is split across the workers instead. False
+  // if a merge failed; its runs are back in JQ and merge_failed is set.
+  bool merge_down(size_t keep) {
+    // Workers are stopped; the lock is also for stats() callers
+    std::unique_lock<std::mutex> lock(state_mutex);
+    std::condition_variable merged_one;
+    size_t in_flight = 0;
+    bool failed = false;
+    auto merge_some = [&](std::unique_lock<std::mutex> &held, IoScratch &io) {
+      while (!failed) {
+        // Every merge in flight will leave one run behind
+        size_t count = JQ.size() + in_flight;
+        if (count <= keep) {
+          return;
+        }
+        size_t width = fan_in;
+        if (count > static_cast<size_t>(fan_in)) {
+          width = (count - 2) % (fan_in - 1) + 2;
+        }
+        width = std::min(width, count);
+        if (JQ.size() < width) {
+          merged_one.wait(held);
+          continue;
+        }
+        std::vector<Job> group(JQ.begin(), std::next(JQ.begin(), width));
 
-    const K &current() const { return buffer[pos]; }
+        int tgt_level = group.front().level;
+        bool same_level = true;
+        for (const Job &job : group) {
+          tgt_level = std::max(tgt_level, job.level);
+          same_level &= job.level == group.front().level;
+        }
+        if (same_level) {
+          tgt_level++;
+        }
+        fprintf(stderr, "Merging %zu files from %s into level %d\n",
+                group.size(), group.front().filename().c_str(), tgt_level);
 
-    void advance() {
-      pos++;
-      if (pos >= count) {
-        refill();
+        JQ.erase(JQ.begin(), std::next(JQ.begin(), width));
+        claim(group);
+        Job merged = new_job(tgt_level, group);
+        // The last pass has no other work to overlap with, so split it
+        bool last_pass = width == count && threads > 1 && codec == Codec::none &&
+                         !varlen && !reducing && top_k == 0;
+        in_flight++;
+        held.unlock();
+        bool ok;
+        {
+          ScopedTimer timer{counters.merge_ns};
+          ok = last_pass ? merge_jobs_partitioned(group, merged)
+                         : merge_jobs(group, merged, io);
+        }
+        held.lock();
+        in_flight--;
+        if (ok) {
+          counters.merged(merged.level);
+          settle(group, &merged);
+          held.unlock();
+          save_checkpoint();
+          remove_runs(group);
+          held.lock();
+        } else {
+          settle(group, nullptr);
+          failed = true;
+        }
+        merged_one.notify_all();
       }
+    };
+    std::vector<std::thread> helpers;
+    for (int p = 1; p < threads && JQ.size() > std::max<size_t>(keep, fan_in); p++) {
+      helpers.emplace_back([&, p]() {
+        std::unique_lock<std::mutex> held(state_mutex);
+        merge_some(held, *scratch[p]);
+      });
+    }
+    merge_some(lock, *scratch[0]);
+    lock.unlock();
+    for (auto &t : helpers) {
+      t.join();
     }
+    merge_failed = merge_failed || failed;
+    return !failed;
+  }
+
+  // False once a merge has failed. The runs it left are kept on disk, and
+  // in the manifest with checkpoint set, and nothing reads them as output.
+  bool ok() const { return !merge_failed; }
+
+  // True when the constructor took over the runs of an earlier sorter's
+  // checkpoint; call finish() or stream() without pushing anything
+  bool resumed() const { return was_resumed; }
+
+  // Returns the output file, or an empty string if the output stayed in
+  // memory; execute() reads it either way. The file is a plain array of K
+  // only without a codec and for raw_record K. Otherwise it holds the same
+  // frames as a spilled run: each a FrameHeader of raw and packed sizes
+  // (packed 0 if stored as is), then the payload, which decodes to whole
+  // records or, for Serial<K>, to length-prefixed records. If a merge
+  // fails this returns an empty string too, with ok() false; execute()
+  // then hands out nothing, and a checkpointed sort can be resumed.
+  std::string finish() {
+    spill_remaining();
+    if (!merge_down(1)) {
+      return std::string();
+    }
+    retire_checkpoint();
+    return JQ.empty() ? std::string() : path_of(*JQ.begin());
+  }
+
+  // Sorted run held in memory, read like a run file
+  struct MemoryReader {
+    const K *pos;
+    const K *end;
+
+    bool ok() const { return true; }
+    bool has_more() const { return pos < end; }
+    const K &current() const { return *pos; }
+    void advance() { pos++; }
   };
 
-  // Batched writer for efficient file writing
-  struct BatchedWriter {
-    std::ofstream &file;
-    K *buffer;
-    size_t buffer_size;
-    size_t pos;
+  // Up to `n` records spread evenly over the output, in sort order; see
+  // pick_splitters() for what they are for. Call once every push() is
+  // done, before stream() or after finish(). The input is spilled and
+  // merged down to the last pass first, and the samples are read from the
+  // runs that pass would merge, so the output is never written out whole.
+  std::vector<K> sample(size_t n) {
+    spill_remaining();
+    std::vector<K> out;
+    if (!merge_down(fan_in)) {
+      return out;
+    }
+    size_t total = 0;
+    for (const BatchEntry &b : resident) {
+      total += b.to - b.from;
+    }
+    for (const Job &job : JQ) {
+      total += job.records;
+    }
+    n = std::min(n, total);
+    if (n == 0) {
+      return out;
+    }
+    // Each run gets its share of `n`, rounded so the shares add up to it
+    size_t seen = 0;
+    auto share = [&](size_t len) {
+      size_t take = n * (seen + len) / total - n * seen / total;
+      seen += len;
+      return take;
+    };
+    for (const BatchEntry &b : resident) {
+      size_t len = b.to - b.from;
+      size_t take = share(len);
+      for (size_t i = 0; i < take; i++) {
+        out.push_back(b.from[i * len / take]);
+      }
+    }
+    for (const Job &job : JQ) {
+      size_t take = share(job.records);
+      if (take > 0 && !sample_run(path_of(job), take, out)) {
+        return {};
+      }
+    }
+    std::sort(out.begin(), out.end(), C());
+    return out;
+  }
 
-    BatchedWriter(std::ofstream &f, K *buf, size_t buf_size)
-        : file(f), buffer(buf), buffer_size(buf_size), pos(0) {}
+  // Add up to `n` records spread evenly over the run `file` to `out`
+  bool sample_run(const std::string &file, size_t n, std::vector<K> &out) {
+    if (!varlen && codec == Codec::none) {
+      size_t count;
+      if (!run_records(file, count)) {
+        return false;
+      }
+      std::ifstream in{file, std::ios::binary};
+      size_t take = std::min(n, count);
+      for (size_t i = 0; i < take; i++) {
+        out.push_back(read_at(in, i * count / take));
+      }
+      return static_cast<bool>(in);
+    }
+    // Framed runs can't be indexed into, so read them through once keeping
+    // every stride-th record, and double the stride whenever 2n are kept
+    std::vector<K> kept;
+    size_t stride = 1;
+    size_t seen = 0;
+    bool read = with_sources(std::vector<Slice>{Slice{file, 0, to_end}}, *scratch[0],
+                             [&](auto &sources) {
+                               for (auto &src = sources[0]; src.has_more(); src.advance()) {
+                                 if (seen++ % stride != 0) {
+                                   continue;
+                                 }
+                                 kept.push_back(src.current());
+                                 if (kept.size() == 2 * n) {
+                                   kept = thin_to(kept, n);
+                                   stride *= 2;
+                                 }
+                               }
+                             });
+    if (kept.size() > n) {
+      kept = thin_to(kept, n);
+    }
+    out.insert(out.end(), kept.begin(), kept.end());
+    return read;
+  }
 
-    void write(const K &item) {
-      buffer[pos++] = item;
-      if (pos >= buffer_size) {
-        flush();
+  // `n` records of `from`, evenly spaced
+  static std::vector<K> thin_to(const std::vector<K> &from, size_t n) {
+    std::vector<K> out;
+    for (size_t i = 0; i < n; i++) {
+      out.push_back(from[i * from.size() / n]);
+    }
+    return out;
+  }
+
+  std::unique_ptr<SourceSet<MemoryReader>> resident_sources() const {
+    auto set = std::make_unique<SourceSet<MemoryReader>>();
+    for (const BatchEntry &b : resident) {
+      set->readers.push_back(MemoryReader{b.from, b.to});
+    }
+    return set;
+  }
+
+  // Pull side of a K-way merge
+  struct Cursor {
+    virtual ~Cursor() = default;
+    virtual bool has_more() const = 0;
+    virtual const K &current() const = 0;
+    virtual void advance() = 0;
+    // False if a source failed; it then ends early
+    virtual bool ok() const = 0;
+  };
+
+  // Cursor owning the sources it merges
+  template <class Set> struct MergeCursor : Cursor {
+    using Source = typename decltype(Set::readers)::value_type;
+    std::unique_ptr<Set> set;
+    LoserTree<K, C, Source> tree;
+
+    explicit MergeCursor(std::unique_ptr<Set> set)
+        : set(std::move(set)), tree(pointers(*this->set)) {}
+
+    static std::vector<Source *> pointers(Set &set) {
+      std::vector<Source *> sources;
+      for (auto &r : set.readers) {
+        sources.push_back(&r);
       }
+      return sources;
     }
 
-    void flush() {
-      if (pos > 0) {
-        file.write(reinterpret_cast<const char *>(buffer), pos * sizeof(K));
-        pos = 0;
+    bool has_more() const override { return !tree.empty(); }
+    const K &current() const override { return tree.top(); }
+    void advance() override { tree.pop(); }
+    bool ok() const override {
+      for (const Source &r : set->readers) {
+        if (!r.ok()) {
+          return false;
+        }
       }
+      return true;
     }
   };
 
-  // Merge two in-memory sorted ranges and write to file
-  static void merge_to_file(std::ofstream &out, K *&b1, K *b1_end, K *&b2, K *b2_end) {
-    while (b1 < b1_end && b2 < b2_end) {
-      if (C()(*b1, *b2)) {
-        write_item(out, *b1++);
+  // The sorted output, merged from the last round of runs as it is read.
+  // Works as a range or through has_more/current/advance. The runs are
+  // removed when it is destroyed, unless ok() is false, and it must not
+  // outlive the sorter.
+  class Stream {
+  public:
+    Stream() = default;
+    Stream(Stream &&other) noexcept
+        : cursor(std::move(other.cursor)), names(std::exchange(other.names, {})),
+          left(other.left), group(std::move(other.group)), grouped(other.grouped),
+          failed(other.failed) {}
+    Stream &operator=(Stream &&other) noexcept {
+      std::swap(cursor, other.cursor);
+      std::swap(names, other.names);
+      std::swap(left, other.left);
+      std::swap(group, other.group);
+      std::swap(grouped, other.grouped);
+      std::swap(failed, other.failed);
+      return *this;
+    }
+    ~Stream() {
+      cursor.reset();
+      if (failed) {
+        return;
+      }
+      for (const std::string &name : names) {
+        std::filesystem::remove(name);
+      }
+    }
+
+    // False if the runs could not be opened or a read failed, so the
+    // output stopped short. The runs are then left on disk.
+    bool ok() const { return !failed; }
+
+    bool has_more() const {
+      if constexpr (reducing) {
+        return left > 0 && grouped;
+      }
+      return left > 0 && cursor && cursor->has_more();
+    }
+    const K &current() const {
+      if constexpr (reducing) {
+        return group;
+      }
+      return cursor->current();
+    }
+    void advance() {
+      if constexpr (reducing) {
+        next_group();
       } else {
-        write_item(out, *b2++);
+        cursor->advance();
+        check_drained();
       }
+      left--;
     }
-    while (b1 < b1_end) {
-      write_item(out, *b1++);
+
+    struct iterator {
+      Stream *stream;
+      const K &operator*() const { return stream->current(); }
+      iterator &operator++() {
+        stream->advance();
+        return *this;
+      }
+      // Only ever compared against end()
+      bool operator!=(const iterator &) const { return stream->has_more(); }
+    };
+    iterator begin() { return iterator{this}; }
+    iterator end() { return iterator{this}; }
+
+  private:
+    friend struct Sorter2048;
+    std::unique_ptr<Cursor> cursor;
+    std::vector<std::string> names;
+    // Records still to hand out under top_k
+    size_t left = to_end;
+    // With Reduce, the next record handed out: the runs' equal records
+    // read so far, folded together
+    K group{};
+    bool grouped = false;
+    bool failed = false;
+
+    void next_group() {
+      if constexpr (reducing) {
+        grouped = cursor && fold_next(*cursor, group);
+      }
+      check_drained();
     }
-    while (b2 < b2_end) {
-      write_item(out, *b2++);
+
+    // A source that fails just runs dry, so look once the merge has
+    void check_drained() {
+      if (failed || !cursor || cursor->has_more() || cursor->ok()) {
+        return;
+      }
+      failed = true;
+      std::cerr << "Failed to read runs for stream():";
+      for (const std::string &name : names) {
+        std::cerr << " " << name;
+      }
+      std::cerr << std::endl;
     }
+  };
+
+  // stream() on a thread of its own. Call once every push() is done, then
+  // block on the future only when the output is wanted; spilling and
+  // merging run meanwhile.
+  std::future<Stream> stream_async() {
+    return std::async(std::launch::async, [this]() { return stream(); });
   }
 
-  // Merge two sorted files into an output file
-  static bool merge_files(std::ifstream &f1, std::ifstream &f2, std::ofstream &out) {
-    K k1, k2;
-    bool has_k1 = read_item(f1, k1);
-    bool has_k2 = read_item(f2, k2);
-    while (has_k1 && has_k2) {
-      if (C()(k1, k2)) {
-        write_item(out, k1);
-        has_k1 = read_item(f1, k1);
-      } else {
-        write_item(out, k2);
-        has_k2 = read_item(f2, k2);
-      }
+  // Like finish(), but stop short of the last merge pass and hand back a
+  // Stream that does it as the output is consumed, so the result is never
+  // written out and read back as one file. Call instead of finish().
+  Stream stream() {
+    spill_remaining();
+    Stream out;
+    out.left = top_k > 0 ? top_k : to_end;
+    if (JQ.empty()) {
+      retire_checkpoint();
+      out.cursor = std::make_unique<MergeCursor<SourceSet<MemoryReader>>>(
+          resident_sources());
+      out.next_group();
+      return out;
+    }
+    // More than fan_in runs would overrun the I/O scratch, so a failed
+    // merge leaves them all where they are
+    if (!merge_down(fan_in)) {
+      out.failed = true;
+      return out;
+    }
+    std::vector<Slice> slices;
+    for (const Job &job : JQ) {
+      slices.push_back(Slice{path_of(job), 0, to_end});
+    }
+    bool opened = open_sources(slices, *scratch[0], [&](auto set) {
+      using Set = typename decltype(set)::element_type;
+      out.cursor = std::make_unique<MergeCursor<Set>>(std::move(set));
+    });
+    if (!opened) {
+      // Leave the runs in JQ, and on disk, for another try
+      out.failed = true;
+      return out;
     }
-    while (has_k1) {
-      write_item(out, k1);
-      has_k1 = read_item(f1, k1);
+    for (const Slice &slice : slices) {
+      out.names.push_back(slice.name);
     }
-    while (has_k2) {
-      write_item(out, k2);
-      has_k2 = read_item(f2, k2);
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      JQ.clear();
+    }
+    retire_checkpoint();
+    out.next_group();
+    return out;
+  }
+
+  // stream() the output into `shuffle`, a RangeShuffle, and flush it.
+  // False if the runs could not all be read.
+  template <class Shuffle> bool stream_to(Shuffle &shuffle) {
+    Stream out = stream();
+    for (const K &rec : out) {
+      shuffle.push(rec);
+    }
+    shuffle.flush();
+    return out.ok();
+  }
+
+  // Move the next record of `src` into `into`, along with every record
+  // after it that Reduce folds into it. False once `src` is empty.
+  template <class Src> static bool fold_next(Src &src, K &into) {
+    if (!src.has_more()) {
+      return false;
+    }
+    into = src.current();
+    src.advance();
+    if constexpr (reducing) {
+      while (src.has_more() && !C()(into, src.current())) {
+        Reduce()(into, src.current());
+        src.advance();
+      }
     }
     return true;
   }
 
-  // Write a batch entry to file
-  static void write_batch_to_file(std::ofstream &out, K *from, K *to) {
-    while (from < to) {
-      write_item(out, *from++);
+  // Hand the first `left` records of `src` to `f`, folding equal ones
+  // together first with Reduce
+  template <class Src, class F> static void emit(Src &src, size_t left, const F &f) {
+    if constexpr (reducing) {
+      K rec;
+      for (; left > 0 && fold_next(src, rec); left--) {
+        f(static_cast<const K &>(rec));
+      }
+    } else {
+      for (; left > 0 && src.has_more(); src.advance(), left--) {
+        f(src.current());
+      }
     }
   }
 
-  Sorter2048(int threads, long long maxMem, const std::string &workdir)
-      : done(false), threads(threads), maxMem(maxMem), workdir(workdir),
-        work_file_prefix{workdir + "/B"}, push_queue(10,threads, 1),
-        managerThread{std::thread{[this]() { manage_sorting(); }}} {
-    std::filesystem::create_directories(workdir);
+  template <class F> void execute(const F &f) {
+    if (merge_failed) {
+      return;
+    }
+    if (JQ.empty()) {
+      MergeCursor<SourceSet<MemoryReader>> merged(resident_sources());
+      emit(merged, record_limit(), f);
+      return;
+    }
+    std::string file = path_of(*JQ.begin());
+    with_sources(std::vector<Slice>{Slice{file, 0, to_end}}, *scratch[0],
+                 [&](auto &sources) { emit(sources[0], record_limit(), f); });
   }
-  ~Sorter2048() {
-    done.store(true);
-    if (managerThread.joinable()) {
-      managerThread.join();
+  // Wait for a free queue slot, then hand the batch to the workers,
+  // through the producer's own sub-queue when it has a token
+  void enqueue_batch(const BatchEntry &be, moodycamel::ProducerToken *token = nullptr) {
+    if (!free_slots.tryWait()) {
+      auto start = std::chrono::steady_clock::now();
+      free_slots.wait();
+      note_stall(start);
     }
+    if (token != nullptr) {
+      push_queue.enqueue(*token, be);
+    } else {
+      push_queue.enqueue(be);
+    }
+    work.signal();
+  }
 
+  // Charge a push() buffer to the budget, counting any wait as a stall
+  void acquire_for_push(long long bytes) {
+    auto start = std::chrono::steady_clock::now();
+    if (memory.acquire(bytes)) {
+      note_stall(start);
+    }
   }
 
-  void manage_sorting() {
-    // printf("Nice\n");
-    // printf("Threads: %d\nMaximum Memory: %lld\n", threads, maxMem);
+  void note_stall(std::chrono::steady_clock::time_point since) {
+    counters.push_stalls++;
+    counters.push_stall_ns += elapsed_ns(since);
+  }
 
-    while (!done.load()) {
-      BatchEntry job;
-      if (push_queue.try_dequeue(job)) {
-        std::sort(job.from, job.to, C());
-        waitroom.push(job);
-      }
-      if (waitroom.size() > 1) {
-        // Merge sorted entries and write to disk
-        Job j{job_idx++, 0};
-        std::ofstream of{work_file_prefix + j.filename(), std::ios::binary};
-        if (!of) {
-          std::cerr << "Failed to open file for writing: "
-                    << work_file_prefix + j.filename() << std::endl;
-          continue;
+  // Drop one reference to `run`; the last one hands it to the workers
+  void release_run(RunBuilder *run) {
+    if (run->refs.fetch_sub(1) == 1) {
+      BatchEntry be{run->buffer, run->buffer + run->fill};
+      be.heap_bytes = run->heap_bytes.load();
+      memory.unpin(static_cast<long long>(be.heap_bytes));
+      delete run;
+      enqueue_batch(be);
+    }
+  }
+
+  // Hand a partially filled run to the workers, giving back its unused tail
+  void flush_open_run() {
+    RunBuilder *run;
+    {
+      std::lock_guard<std::mutex> lock(fill_mutex);
+      run = open_run;
+      open_run = nullptr;
+    }
+    close_run(run);
+  }
+
+  // Drop the builder's reference to a run taken off open_run
+  void close_run(RunBuilder *run) {
+    if (run == nullptr) {
+      return;
+    }
+    memory.unpin(static_cast<long long>(run->capacity) * sizeof(K));
+    memory.release(static_cast<long long>(run->capacity - run->fill) *
+                   sizeof(K));
+    if (run->fill == 0) {
+      free_run(run->buffer);
+      delete run;
+      return;
+    }
+    release_run(run);
+  }
+
+  // Counters and queue depths as of now. Safe to call from any thread
+  // while the sort runs.
+  SortStats stats() {
+    auto seconds = [](unsigned long long ns) { return ns / 1e9; };
+    SortStats s;
+    s.records_pushed = counters.records_pushed.load();
+    s.runs_sorted = counters.runs_sorted.load();
+    s.sort_seconds = seconds(counters.sort_ns.load());
+    s.merge_seconds = seconds(counters.merge_ns.load());
+    s.bytes_spilled = counters.bytes_spilled.load();
+    s.bytes_read = counters.bytes_read.load();
+    s.push_stalls = counters.push_stalls.load();
+    s.push_stall_seconds = seconds(counters.push_stall_ns.load());
+    s.queued_batches = push_queue.size_approx();
+    {
+      std::lock_guard<std::mutex> lock(state_mutex);
+      s.waitroom_runs = waitroom.size();
+      for (const Job &job : JQ) {
+        if (s.files_per_level.size() <= static_cast<size_t>(job.level)) {
+          s.files_per_level.resize(job.level + 1);
         }
-        BatchEntry b1 = waitroom.front();
-        K *b1f = b1.from;
-        waitroom.pop();
-        BatchEntry b2 = waitroom.front();
-        K *b2f = b2.from;
-        waitroom.pop();
-        merge_to_file(of, b1.from, b1.to, b2.from, b2.to);
-        delete[] b1f;
-        delete[] b2f;
-        JQ.insert(j);
-      }
-      while (JQ.size() > 1) {
-        auto first = JQ.begin();
-        auto second = std::next(first);
-        if (second != JQ.end() && first->level == second->level) {
-          // Store job info before erasing iterators
-          Job job1 = *first;
-          Job job2 = *second;
-          Job merged{job_idx++, job1.level + 1};
-
-
-          JQ.erase(second);
-          JQ.erase(first);
-
-          std::ofstream of{work_file_prefix + merged.filename(),
-                           std::ios::binary};
-          if (!of) {
-            std::cerr << "Failed to open file for writing: "
-                      << work_file_prefix + merged.filename() << std::endl;
-            // Re-insert jobs since we couldn't merge
-            JQ.insert(job1);
-            JQ.insert(job2);
-            continue;
-          }
-          std::ifstream f1{work_file_prefix + job1.filename(),
-                           std::ios::binary};
-          std::ifstream f2{work_file_prefix + job2.filename(),
-                           std::ios::binary};
-          if (!f1 || !f2) {
-            std::cerr << "Failed to open file for reading: "
-                      << work_file_prefix + job1.filename() << " or "
-                      << work_file_prefix + job2.filename() << std::endl;
-            // Re-insert jobs since we couldn't merge
-            JQ.insert(job1);
-            JQ.insert(job2);
-            continue;
-          }
-          merge_files(f1, f2, of);
-          std::filesystem::remove(work_file_prefix + job1.filename());
-          std::filesystem::remove(work_file_prefix + job2.filename());
-          JQ.insert(merged);
+        s.files_per_level[job.level]++;
+      }
+    }
+    for (int level = 0; level < stat_levels; level++) {
+      if (unsigned long long n = counters.merges[level].load()) {
+        s.merges_per_level.resize(level + 1);
+        s.merges_per_level[level] = n;
+      }
+    }
+    s.memory_in_use = memory.in_use();
+    return s;
+  }
+
+  // Copy a batch into run_capacity sized runs, blocking while the memory
+  // budget is used up. Batches are split or coalesced as needed, so run
+  // size does not depend on how callers batch their input.
+  void push(K *from, K *to) {
+    counters.records_pushed += std::distance(from, to);
+    if constexpr (varlen) {
+      // Taken before holding any run, which a full one waits on, and
+      // pinned with the runs the records go to until those are sent
+      long long bytes = static_cast<long long>(heap_bytes_of(from, to));
+      acquire_for_push(bytes);
+      memory.pin(bytes);
+    }
+    while (from < to) {
+      RunBuilder *run;
+      RunBuilder *spent = nullptr;
+      K *dst;
+      size_t n;
+      {
+        std::lock_guard<std::mutex> lock(fill_mutex);
+        // A run whose records hold more on the heap than its slab goes out
+        // early, so an open run stays within twice its slab
+        if (open_run != nullptr && open_run->heap_bytes >= open_run->capacity * sizeof(K)) {
+          spent = std::exchange(open_run, nullptr);
+        }
+        if (open_run == nullptr) {
+          acquire_for_push(static_cast<long long>(run_capacity) * sizeof(K));
+          memory.pin(static_cast<long long>(run_capacity) * sizeof(K));
+          open_run = new RunBuilder{allocate_run(), run_capacity, 0, 1};
         }
-        else{
-            break;
+        run = open_run;
+        n = std::min<size_t>(std::distance(from, to), run->capacity - run->fill);
+        dst = run->buffer + run->fill;
+        run->fill += n;
+        run->refs++;
+        if (run->fill == run->capacity) {
+          // Full: drop the builder's reference, ours keeps it alive
+          open_run = nullptr;
+          run->refs--;
+          memory.unpin(static_cast<long long>(run->capacity) * sizeof(K));
         }
       }
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      close_run(spent);
+      std::copy(from, from + n, dst);
+      if constexpr (varlen) {
+        run->heap_bytes += heap_bytes_of(from, from + n);
+      }
+      from += n;
+      release_run(run);
     }
   }
-  std::string finish() {
-    done.store(true);
-    managerThread.join();
-    // Empty Waitrom
-    while (push_queue.size_approx() > 0) {
-      BatchEntry job;
-      if (push_queue.try_dequeue(job)) {
-        std::sort(job.from, job.to, C());
-        waitroom.push(job);
-      }
+  // Ingest handle for one producer thread. Records pushed through it are
+  // copied into a run buffer of its own, so producers share nothing until
+  // a full run goes to the workers, through a sub-queue of push_queue
+  // tied to this handle. The run is sent off when the handle is flushed
+  // or destroyed; destroy every Producer before finish() or stream(),
+  // which report any still open. Handles move but do not copy.
+  class Producer {
+  public:
+    explicit Producer(Sorter2048 &sorter) : sorter(sorter), token(sorter.push_queue) {
+      sorter.live_producers++;
     }
-    while (waitroom.size() > 0) {
-      BatchEntry b = waitroom.front();
-      K * bf = b.from;
-      waitroom.pop();
-      Job j{job_idx++, 0};
-      std::ofstream of{work_file_prefix + j.filename(), std::ios::binary};
-      if (!of) {
-        std::cerr << "Failed to open file for writing: "
-                  << work_file_prefix + j.filename() << std::endl;
-        continue;
+    // The moved-from handle is left empty and no longer counts as live
+    Producer(Producer &&other) noexcept
+        : sorter(other.sorter), token(std::move(other.token)),
+          run(std::exchange(other.run, nullptr)), fill(std::exchange(other.fill, 0)),
+          heap_bytes(std::exchange(other.heap_bytes, 0)),
+          live(std::exchange(other.live, false)) {}
+    ~Producer() {
+      if (live) {
+        flush();
+        sorter.live_producers--;
       }
-      write_batch_to_file(of, b.from, b.to);
-      JQ.insert(j);
-      delete[] bf;
     }
-    while (JQ.size() > 1) {
-      auto first = JQ.begin();
-      auto second = std::next(first);
-      if (second == JQ.end()) break;
+    Producer(const Producer &) = delete;
+    Producer &operator=(const Producer &) = delete;
 
-      // Store job info before erasing
-      Job job1 = *first;
-      Job job2 = *second;
-
-      int tgt_level = std::max(job1.level, job2.level);
-      if (job1.level == job2.level) {
-          tgt_level++;
+    void push(const K *from, const K *to) {
+      while (from < to) {
+        if (run == nullptr) {
+          sorter.acquire_for_push(static_cast<long long>(sorter.run_capacity) * sizeof(K));
+          sorter.memory.pin(static_cast<long long>(sorter.run_capacity) * sizeof(K));
+          run = sorter.allocate_run();
+        }
+        size_t n = std::min<size_t>(std::distance(from, to), sorter.run_capacity - fill);
+        if constexpr (varlen) {
+          size_t bytes = heap_bytes_of(from, from + n);
+          sorter.acquire_for_push(static_cast<long long>(bytes));
+          sorter.memory.pin(static_cast<long long>(bytes));
+          heap_bytes += bytes;
+        }
+        std::copy(from, from + n, run + fill);
+        fill += n;
+        from += n;
+        if (fill == sorter.run_capacity) {
+          send();
+        } else if (heap_bytes >= sorter.run_capacity * sizeof(K)) {
+          // Records holding more on the heap than the slab send it early
+          flush();
+        }
       }
-      fprintf(stderr, "Merging files: %s and %s into level %d\n",
-              job1.filename().c_str(), job2.filename().c_str(), tgt_level);
+    }
 
-      // Erase iterators first
-      JQ.erase(second);
-      JQ.erase(first);
+    void push(const K &rec) { push(&rec, &rec + 1); }
 
-      Job merged{job_idx++, tgt_level};
-      std::ofstream of{work_file_prefix + merged.filename(), std::ios::binary};
-      if (!of) {
-        std::cerr << "Failed to open file for writing: "
-                  << work_file_prefix + merged.filename() << std::endl;
-        JQ.insert(job1);
-        JQ.insert(job2);
-        continue;
+    // Send the partly filled run now, giving back its unused tail
+    void flush() {
+      if (run == nullptr) {
+        return;
       }
-      std::ifstream f1{work_file_prefix + job1.filename(), std::ios::binary};
-      std::ifstream f2{work_file_prefix + job2.filename(), std::ios::binary};
-      if (!f1 || !f2) {
-        std::cerr << "Failed to open file for reading: "
-                  << work_file_prefix + job1.filename() << " or "
-                  << work_file_prefix + job2.filename() << std::endl;
-        JQ.insert(job1);
-        JQ.insert(job2);
-        continue;
+      sorter.memory.release(static_cast<long long>(sorter.run_capacity - fill) * sizeof(K));
+      if (fill == 0) {
+        sorter.memory.unpin(static_cast<long long>(sorter.run_capacity) * sizeof(K));
+        sorter.free_run(run);
+        run = nullptr;
+        return;
       }
-      merge_files(f1, f2, of);
-      std::filesystem::remove(work_file_prefix + job1.filename());
-      std::filesystem::remove(work_file_prefix + job2.filename());
-      JQ.insert(merged);
-    }
-    return work_file_prefix + JQ.begin()->filename();
-  }
-  template <class F> void execute(const F &f) {
-    std::string file = work_file_prefix + JQ.begin()->filename();
-    std::ifstream in{file, std::ios::binary};
-    if (!in) {
-      std::cerr << "Failed to open file for reading: " << file << std::endl;
-      return;
+      send();
     }
-    K k;
-    while (read_item(in, k)) {
-      f(k);
+
+  private:
+    void send() {
+      sorter.memory.unpin(static_cast<long long>(sorter.run_capacity * sizeof(K) + heap_bytes));
+      sorter.counters.records_pushed += fill;
+      BatchEntry be{run, run + fill};
+      be.heap_bytes = std::exchange(heap_bytes, 0);
+      sorter.enqueue_batch(be, &token);
+      run = nullptr;
+      fill = 0;
     }
 
+    Sorter2048 &sorter;
+    moodycamel::ProducerToken token;
+    K *run = nullptr;
+    size_t fill = 0;
+    size_t heap_bytes = 0;
+    bool live = true;
+  };
+
+  // A Producer for the calling thread
+  Producer producer() { return Producer(*this); }
+
+  // Hand a batch over without copying. The vector's buffer becomes a run of
+  // its own; once spilled it is offered back through reclaim().
+  void push(std::vector<K> &&batch) {
+    if (batch.empty()) {
+      return;
+    }
+    counters.records_pushed += batch.size();
+    size_t heap = heap_bytes_of(batch.data(), batch.data() + batch.size());
+    acquire_for_push(static_cast<long long>(batch.size() * sizeof(K) + heap));
+    auto *owner = new std::vector<K>(std::move(batch));
+    BatchEntry be{owner->data(), owner->data() + owner->size(), owner};
+    be.heap_bytes = heap;
+    enqueue_batch(be);
   }
-  void push(K *from, K *to) {
-    // Copy first
-    BatchEntry be{new K[std::distance(from, to)], 0};
-    std::copy(from, to, be.from);
-    be.to = be.from + std::distance(from, to);
 
+  // Hand over an array allocated with new K[]; it is freed once spilled
+  void push(std::unique_ptr<K[]> batch, size_t count) {
+    if (count == 0) {
+      return;
+    }
+    counters.records_pushed += count;
+    size_t heap = heap_bytes_of(batch.get(), batch.get() + count);
+    acquire_for_push(static_cast<long long>(count * sizeof(K) + heap));
+    K *from = batch.release();
+    BatchEntry be{from, from + count};
+    be.heap_bytes = heap;
+    enqueue_batch(be);
+  }
 
-    while(!push_queue.try_enqueue(be)){
-        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  // Take back a spent buffer from an earlier push(std::vector<K> &&), empty
+  // but with its capacity intact. Returns false if none is ready yet.
+  bool reclaim(std::vector<K> &buffer) {
+    std::vector<K> *spent;
+    if (!spent_buffers.try_dequeue(spent)) {
+      return false;
     }
+    spent_count--;
+    buffer = std::move(*spent);
+    delete spent;
+    return true;
   }
+
   std::atomic<bool> done;
   int threads;
   long long maxMem;
+  int fan_in;
+  Codec codec;
+  int codec_level;
+  bool async_io;
+  bool direct_io;
+  size_t io_block_bytes;
+  int recycled_buffers;
+  size_t parallel_sort_min;
+  bool mapped_io;
+  bool in_memory;
+  bool replacement;
+  bool index_sort;
+  size_t top_k;
+  bool checkpointing;
+  // Set by finish() or stream() once every pushed record is in a run on
+  // disk, and carried over by resume()
+  bool input_complete = false;
+  bool was_resumed = false;
+  // Set by merge_down() once a merge has failed
+  bool merge_failed = false;
+  // Runs taken out of JQ by merges still in flight, which the manifest keeps
+  // listing until the merged run replaces them. Guarded by state_mutex.
+  std::vector<Job> merging;
+  // Newest manifest snapshot not yet taken by save_checkpoint(), and the
+  // count of snapshots made, both guarded by state_mutex; the newest saved
+  // is guarded by manifest_mutex
+  std::string manifest_pending;
+  uint64_t manifest_seq = 0;
+  std::mutex manifest_mutex;
+  std::condition_variable manifest_stored;
+  uint64_t manifest_saved = 0;
+  // top_k fits in one run, so it is kept in the waitroom as one run
+  bool hold_top = false;
+  SpillPlacement spill_placement;
+  std::vector<std::string> spill_dirs;
+  std::vector<std::string> spill_prefixes;
+  std::vector<dev_t> spill_devices;
+  // Free bytes in each spill directory as of the last run written there,
+  // for free_space placement; statfs stays out of state_mutex this way
+  std::unique_ptr<std::atomic<std::uintmax_t>[]> spill_free;
+  // The first spill directory and its run file prefix
   std::string workdir;
   std::string work_file_prefix;
+  std::atomic<unsigned> next_dir{0};
   std::queue<BatchEntry> waitroom;
+  // With hold_top, the last record of a full top_k run waiting in the
+  // waitroom; nothing ordered after it can make the cut. Guarded by
+  // state_mutex.
+  bool have_cutoff = false;
+  K cutoff{};
+  // Set once any run goes to disk, which ends the in_memory hold
+  std::atomic<bool> spilled{false};
+  // Sorted runs finish() kept in memory because nothing spilled
+  std::vector<BatchEntry> resident;
+  // Replacement selection state, touched only under rs_mutex; rs_pending
+  // is guarded by state_mutex
+  std::mutex rs_mutex;
+  std::queue<BatchEntry> rs_pending;
+  std::vector<Tagged> rs_heap;
+  size_t rs_capacity = 0;
+  std::vector<K> rs_block;
+  std::vector<char> rs_packed;
+  std::vector<char> rs_bytes;
+  size_t rs_fill = 0;
+  Job rs_job{0, 0};
+  unsigned rs_run = 0;
+  bool rs_open = false;
+  bool rs_fresh = false;
+  K rs_last{};
   moodycamel::ConcurrentQueue<BatchEntry> push_queue;
+  // Counts queue_depth minus the batches waiting in push_queue
+  moodycamel::LightweightSemaphore free_slots;
+  // Signalled whenever a worker may find something to do
+  moodycamel::LightweightSemaphore work;
+  // Workers in sort_one_batch(). While draining is set, the one that
+  // brings it to zero notifies drained, under state_mutex.
+  std::atomic<int> sorting{0};
+  std::atomic<bool> draining{false};
+  std::condition_variable drained;
+  // Producer handles not yet destroyed; pushes through one after finish()
+  // or stream() would be lost
+  std::atomic<int> live_producers{0};
+  moodycamel::ConcurrentQueue<SortTask> sort_tasks;
   std::multiset<Job> JQ;
   int job_idx = 0;
+  // Guards waitroom, JQ and job_idx across workers
+  std::mutex state_mutex;
+  size_t run_capacity;
+  MemoryGovernor memory;
+  SlabPool pool;
+  // Guards open_run
+  std::mutex fill_mutex;
+  RunBuilder *open_run = nullptr;
+  // One per worker; finish() and execute() reuse the first after joining
+  std::vector<std::unique_ptr<IoScratch>> scratch;
+  moodycamel::ConcurrentQueue<std::vector<K> *> spent_buffers;
+  std::atomic<int> spent_count{0};
+  Counters counters;
+  // Stops the on_stats thread
+  std::mutex report_mutex;
+  std::condition_variable report_cv;
+  bool reporting = true;
 
   //Keep at the end
-  std::thread managerThread;
+  std::vector<std::thread> workers;
+  std::thread reporter;
 };
 } // namespace Order
 
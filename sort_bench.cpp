@@ -0,0 +1,484 @@
+#include "order.hpp"
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// Reproducible throughput benchmark for Sorter2048. Producers generate
+// their share of the records from a seeded generator and push them in
+// batches, then the output is read back and checked. Timings for each
+// phase are printed as one JSON object:
+//   run_formation  first push until every producer is done; sorting and
+//                  any merges the workers get to meanwhile overlap it
+//   merge          finish(), the merge passes left after that
+//   first_record   end of input until the first output record is read
+//   output         execute(), reading the sorted output back
+//   total          first push until the last record is read
+// With --stream the output is read through stream_async() instead, and
+// merge lasts until its Stream is ready.
+//
+// With --nodes N the sort runs as N nodes in one process, looped back
+// through RangeShuffle. Producers feed the nodes in turn. Each node
+// samples its runs, and pick_splitters() cuts the pooled samples into
+// ranges. Every node then streams its runs through a RangeShuffle into
+// the receiving sorter of the node that owns each range. Phases are then:
+//   run_formation  as above, on the sending sorters
+//   shuffle        sampling, picking splitters and the shuffle itself
+//   first_record   end of input until the first output record is read
+//   output         reading every receiving sorter back in range order
+//   total          first push until the last record is read
+// The threads and memory are shared across the 2N sorters.
+//
+//   sort_bench --records 10000000 --width 32 --dist skewed --mem 256
+
+namespace {
+
+// A record `Width` bytes wide, ordered by its leading 64 bit key
+template <size_t Width> struct Record {
+  static_assert(Width >= sizeof(uint64_t), "records hold at least the key");
+  uint64_t key;
+  std::array<char, Width - sizeof(uint64_t)> payload;
+};
+
+template <size_t Width> struct RecordLess {
+  bool operator()(const Record<Width> &a, const Record<Width> &b) const {
+    return a.key < b.key;
+  }
+};
+
+template <size_t Width> struct RecordKey {
+  uint64_t operator()(const Record<Width> &r) const { return r.key; }
+};
+
+enum class Dist { uniform, skewed, presorted, duplicates };
+
+struct Config {
+  long long records = 10'000'000;
+  size_t width = 16;
+  Dist dist = Dist::uniform;
+  int threads = 4;
+  int producers = 4;
+  long long mem_mb = 1024;
+  size_t batch = 100'000;
+  uint64_t seed = 1;
+  std::string dir = "temp";
+  // Push through a Sorter2048::Producer per producer thread
+  bool handles = false;
+  // Read the output through stream_async() instead of finish()
+  bool stream = false;
+  // Sort as this many nodes looped back through a RangeShuffle
+  int nodes = 1;
+  Order::SortOptions options;
+};
+
+// splitmix64: cheap enough not to dominate run formation, and the same
+// sequence for a given seed everywhere
+struct Generator {
+  uint64_t state;
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  double unit() { return (next() >> 11) * (1.0 / (1ULL << 53)); }
+};
+
+// Key of record `i` of producer `p`
+uint64_t make_key(const Config &cfg, Generator &gen, int p, long long i) {
+  switch (cfg.dist) {
+  case Dist::uniform:
+    return gen.next();
+  case Dist::skewed: {
+    // Most keys crowd the low end of the range, like a Zipf-ish tail
+    double u = gen.unit();
+    return static_cast<uint64_t>(std::pow(u, 8.0) * static_cast<double>(UINT64_MAX));
+  }
+  case Dist::presorted:
+    // Each producer pushes its own ascending range
+    return static_cast<uint64_t>(p) * cfg.records + i;
+  case Dist::duplicates:
+    return gen.next() % 1000;
+  }
+  return 0;
+}
+
+// Records the output should hold
+long long expected_records(const Config &cfg) {
+  size_t k = cfg.options.top_k;
+  return k > 0 ? std::min<long long>(cfg.records, k) : cfg.records;
+}
+
+struct Phase {
+  const char *name;
+  double seconds;
+};
+
+void print_json(const Config &cfg, const char *dist, const std::vector<Phase> &phases,
+                const Order::SortStats &stats, long long count, bool sorted) {
+  double mb = static_cast<double>(cfg.records) * cfg.width / (1 << 20);
+  printf("{\n");
+  printf("  \"records\": %lld,\n", cfg.records);
+  printf("  \"record_bytes\": %zu,\n", cfg.width);
+  printf("  \"distribution\": \"%s\",\n", dist);
+  printf("  \"threads\": %d,\n", cfg.threads);
+  printf("  \"producers\": %d,\n", cfg.producers);
+  printf("  \"producer_handles\": %s,\n", cfg.handles ? "true" : "false");
+  printf("  \"nodes\": %d,\n", cfg.nodes);
+  printf("  \"max_mem_mb\": %lld,\n", cfg.mem_mb);
+  printf("  \"fan_in\": %d,\n", cfg.options.fan_in);
+  printf("  \"seed\": %llu,\n", static_cast<unsigned long long>(cfg.seed));
+  printf("  \"phases\": {\n");
+  for (size_t i = 0; i < phases.size(); i++) {
+    double s = phases[i].seconds;
+    printf("    \"%s\": {\"seconds\": %.6f, \"records_per_s\": %.1f, \"mb_per_s\": %.1f}%s\n",
+           phases[i].name, s, s > 0 ? cfg.records / s : 0.0, s > 0 ? mb / s : 0.0,
+           i + 1 < phases.size() ? "," : "");
+  }
+  printf("  },\n");
+  printf("  \"sort_seconds\": %.6f,\n", stats.sort_seconds);
+  printf("  \"merge_seconds\": %.6f,\n", stats.merge_seconds);
+  printf("  \"bytes_spilled\": %llu,\n", stats.bytes_spilled);
+  printf("  \"bytes_read\": %llu,\n", stats.bytes_read);
+  printf("  \"push_stalls\": %llu,\n", stats.push_stalls);
+  printf("  \"push_stall_seconds\": %.6f,\n", stats.push_stall_seconds);
+  printf("  \"merges_per_level\": [");
+  for (size_t i = 0; i < stats.merges_per_level.size(); i++) {
+    printf("%s%llu", i ? ", " : "", stats.merges_per_level[i]);
+  }
+  printf("],\n");
+  printf("  \"output_records\": %lld,\n", count);
+  printf("  \"sorted\": %s\n", sorted && count == expected_records(cfg) ? "true" : "false");
+  printf("}\n");
+}
+
+// Add the counters of `s` to `into`, for --nodes
+void add_stats(Order::SortStats &into, const Order::SortStats &s) {
+  into.records_pushed += s.records_pushed;
+  into.runs_sorted += s.runs_sorted;
+  into.sort_seconds += s.sort_seconds;
+  into.merge_seconds += s.merge_seconds;
+  into.bytes_spilled += s.bytes_spilled;
+  into.bytes_read += s.bytes_read;
+  into.push_stalls += s.push_stalls;
+  into.push_stall_seconds += s.push_stall_seconds;
+  into.merges_per_level.resize(
+      std::max(into.merges_per_level.size(), s.merges_per_level.size()));
+  for (size_t i = 0; i < s.merges_per_level.size(); i++) {
+    into.merges_per_level[i] += s.merges_per_level[i];
+  }
+}
+
+using Clock = std::chrono::steady_clock;
+
+double seconds(Clock::time_point a, Clock::time_point b) {
+  return std::chrono::duration<double>(b - a).count();
+}
+
+// Run `cfg.producers` threads, each generating its share of the records
+// and handing batches to push(from, to) of its own `make_push(p)`
+template <class K, class MakePush> void produce(const Config &cfg, MakePush make_push) {
+  std::vector<std::thread> producers;
+  for (int p = 0; p < cfg.producers; p++) {
+    producers.emplace_back([&, p]() {
+      Generator gen{cfg.seed * 0x100000001b3ULL + p};
+      auto push = make_push(p);
+      long long first = cfg.records * p / cfg.producers;
+      long long last = cfg.records * (p + 1) / cfg.producers;
+      std::vector<K> data(cfg.batch);
+      size_t fill = 0;
+      for (long long i = first; i < last; i++) {
+        K &r = data[fill++];
+        r.key = make_key(cfg, gen, p, i - first);
+        r.payload.fill(static_cast<char>(i));
+        if (fill == data.size() || i + 1 == last) {
+          push(data.data(), data.data() + fill);
+          fill = 0;
+        }
+      }
+    });
+  }
+  for (auto &t : producers) {
+    t.join();
+  }
+}
+
+// Checks the output is in key order as it is read, and when it started
+template <class K> struct OutputCheck {
+  long long count = 0;
+  bool sorted = true;
+  uint64_t prev = 0;
+  Clock::time_point first;
+
+  void operator()(const K &r) {
+    if (count++ == 0) {
+      first = Clock::now();
+    }
+    sorted = sorted && r.key >= prev;
+    prev = r.key;
+  }
+};
+
+// Read all of `sorter`'s output into `check`, through stream() with
+// --stream and execute() otherwise. False if the output could not be read.
+template <class Sorter, class Check> bool read_output(const Config &cfg, Sorter &sorter,
+                                                      Check &check) {
+  if (cfg.stream) {
+    auto out = sorter.stream();
+    for (const auto &r : out) {
+      check(r);
+    }
+    return out.ok();
+  }
+  std::string output = sorter.finish();
+  sorter.execute([&](const auto &r) { check(r); });
+  if (!output.empty()) {
+    std::filesystem::remove(output);
+  }
+  return true;
+}
+
+template <size_t Width> bool run(const Config &cfg, const char *dist) {
+  using K = Record<Width>;
+  using Sorter = Order::Sorter2048<K, RecordLess<Width>, RecordKey<Width>>;
+
+  Sorter sorter(cfg.threads, cfg.mem_mb << 20, cfg.dir, cfg.options);
+
+  auto t0 = Clock::now();
+  produce<K>(cfg, [&](int) {
+    return [&, handle = sorter.producer()](K *from, K *to) mutable {
+      if (cfg.handles) {
+        handle.push(from, to);
+      } else {
+        sorter.push(from, to);
+      }
+    };
+  });
+  auto t1 = Clock::now();
+  OutputCheck<K> check;
+  Clock::time_point t2, t3;
+  if (cfg.stream) {
+    auto pending = sorter.stream_async();
+    auto out = pending.get();
+    t2 = Clock::now();
+    for (const K &r : out) {
+      check(r);
+    }
+    t3 = Clock::now();
+  } else {
+    std::string output = sorter.finish();
+    t2 = Clock::now();
+    sorter.execute([&](const K &r) { check(r); });
+    t3 = Clock::now();
+    if (!output.empty()) {
+      std::filesystem::remove(output);
+    }
+  }
+  long long count = check.count;
+  bool sorted = check.sorted;
+  Clock::time_point first = check.first;
+
+  std::vector<Phase> phases = {{"run_formation", seconds(t0, t1)},
+                               {"merge", seconds(t1, t2)},
+                               {"first_record", seconds(t1, count > 0 ? first : t3)},
+                               {"output", seconds(t2, t3)},
+                               {"total", seconds(t0, t3)}};
+  print_json(cfg, dist, phases, sorter.stats(), count, sorted);
+  return sorted && count == expected_records(cfg);
+}
+
+// The same sort as `cfg.nodes` nodes, each with a sorter for what it
+// generates and one for what the shuffle sends it
+template <size_t Width> bool run_nodes(const Config &cfg, const char *dist) {
+  using K = Record<Width>;
+  using Less = RecordLess<Width>;
+  using Sorter = Order::Sorter2048<K, Less, RecordKey<Width>>;
+
+  const int nodes = cfg.nodes;
+  const int threads = std::max(1, cfg.threads / nodes);
+  const long long mem = std::max(1LL, cfg.mem_mb / (2 * nodes)) << 20;
+  std::vector<std::unique_ptr<Sorter>> local;
+  std::vector<std::unique_ptr<Sorter>> remote;
+  for (int n = 0; n < nodes; n++) {
+    std::string dir = cfg.dir + "/node" + std::to_string(n);
+    local.push_back(std::make_unique<Sorter>(threads, mem, dir + "/local", cfg.options));
+    remote.push_back(std::make_unique<Sorter>(threads, mem, dir + "/remote", cfg.options));
+  }
+
+  auto t0 = Clock::now();
+  produce<K>(cfg, [&](int p) {
+    return [&, p](K *from, K *to) { local[p % nodes]->push(from, to); };
+  });
+  auto t1 = Clock::now();
+
+  // Every node's splitters come from the same pooled samples
+  std::vector<K> samples;
+  for (auto &sorter : local) {
+    std::vector<K> s = sorter->sample(256 * nodes);
+    samples.insert(samples.end(), s.begin(), s.end());
+  }
+  std::vector<K> splitters = Order::pick_splitters<K, Less>(std::move(samples), nodes);
+  std::atomic<bool> read{true};
+  std::vector<std::thread> senders;
+  for (int n = 0; n < nodes; n++) {
+    senders.emplace_back([&, n]() {
+      Order::RangeShuffle<K, Less> shuffle(
+          splitters, [&](int part, K *from, K *to) { remote[part]->push(from, to); });
+      if (!local[n]->stream_to(shuffle)) {
+        read.store(false);
+      }
+    });
+  }
+  for (auto &t : senders) {
+    t.join();
+  }
+  auto t2 = Clock::now();
+
+  // Range order across the nodes is the global order, so one check spans
+  // them all
+  OutputCheck<K> check;
+  for (auto &sorter : remote) {
+    if (!read_output(cfg, *sorter, check)) {
+      read.store(false);
+    }
+  }
+  auto t3 = Clock::now();
+
+  Order::SortStats stats;
+  for (int n = 0; n < nodes; n++) {
+    add_stats(stats, local[n]->stats());
+    add_stats(stats, remote[n]->stats());
+  }
+  bool sorted = check.sorted && read.load();
+  std::vector<Phase> phases = {{"run_formation", seconds(t0, t1)},
+                               {"shuffle", seconds(t1, t2)},
+                               {"first_record",
+                                seconds(t1, check.count > 0 ? check.first : t3)},
+                               {"output", seconds(t2, t3)},
+                               {"total", seconds(t0, t3)}};
+  print_json(cfg, dist, phases, stats, check.count, sorted);
+  return sorted && check.count == expected_records(cfg);
+}
+
+void usage() {
+  fprintf(stderr,
+          "usage: sort_bench [--records N] [--width 8|16|32|64|128|256|512]\n"
+          "                  [--dist uniform|skewed|presorted|duplicates]\n"
+          "                  [--threads N] [--producers N] [--mem MB] [--batch N]\n"
+          "                  [--fan-in N] [--seed N] [--dir PATH]\n"
+          "                  [--codec none|lz4|zstd] [--async] [--no-mmap]\n"
+          "                  [--no-in-memory] [--replacement] [--top-k N]\n"
+          "                  [--handles] [--stream] [--nodes N]\n");
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  Config cfg;
+  const char *dist = "uniform";
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    auto value = [&]() -> const char * {
+      if (i + 1 >= argc) {
+        usage();
+        exit(2);
+      }
+      return argv[++i];
+    };
+    if (arg == "--records") {
+      cfg.records = atoll(value());
+    } else if (arg == "--width") {
+      cfg.width = atoll(value());
+    } else if (arg == "--dist") {
+      dist = value();
+      if (!strcmp(dist, "uniform")) {
+        cfg.dist = Dist::uniform;
+      } else if (!strcmp(dist, "skewed")) {
+        cfg.dist = Dist::skewed;
+      } else if (!strcmp(dist, "presorted")) {
+        cfg.dist = Dist::presorted;
+      } else if (!strcmp(dist, "duplicates")) {
+        cfg.dist = Dist::duplicates;
+      } else {
+        usage();
+        return 2;
+      }
+    } else if (arg == "--threads") {
+      cfg.threads = atoi(value());
+    } else if (arg == "--producers") {
+      cfg.producers = atoi(value());
+    } else if (arg == "--mem") {
+      cfg.mem_mb = atoll(value());
+    } else if (arg == "--batch") {
+      cfg.batch = std::max(1LL, atoll(value()));
+    } else if (arg == "--fan-in") {
+      cfg.options.fan_in = atoi(value());
+    } else if (arg == "--seed") {
+      cfg.seed = strtoull(value(), nullptr, 10);
+    } else if (arg == "--dir") {
+      cfg.dir = value();
+    } else if (arg == "--codec") {
+      std::string c = value();
+      cfg.options.codec = c == "lz4" ? Order::Codec::lz4
+                          : c == "zstd" ? Order::Codec::zstd
+                                        : Order::Codec::none;
+    } else if (arg == "--async") {
+      cfg.options.async_io = true;
+    } else if (arg == "--no-mmap") {
+      cfg.options.mmap_runs = false;
+    } else if (arg == "--no-in-memory") {
+      cfg.options.in_memory = false;
+    } else if (arg == "--replacement") {
+      cfg.options.replacement_selection = true;
+    } else if (arg == "--top-k") {
+      cfg.options.top_k = atoll(value());
+    } else if (arg == "--handles") {
+      cfg.handles = true;
+    } else if (arg == "--stream") {
+      cfg.stream = true;
+    } else if (arg == "--nodes") {
+      cfg.nodes = atoi(value());
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  // Each node would keep top_k of its own range
+  if (cfg.producers < 1 || cfg.threads < 1 || cfg.records < 0 || cfg.nodes < 1 ||
+      (cfg.nodes > 1 && cfg.options.top_k > 0)) {
+    usage();
+    return 2;
+  }
+
+  bool ok;
+  switch (cfg.width) {
+  case 8:
+    ok = cfg.nodes > 1 ? run_nodes<8>(cfg, dist) : run<8>(cfg, dist);
+    break;
+  case 16:
+    ok = cfg.nodes > 1 ? run_nodes<16>(cfg, dist) : run<16>(cfg, dist);
+    break;
+  case 32:
+    ok = cfg.nodes > 1 ? run_nodes<32>(cfg, dist) : run<32>(cfg, dist);
+    break;
+  case 64:
+    ok = cfg.nodes > 1 ? run_nodes<64>(cfg, dist) : run<64>(cfg, dist);
+    break;
+  case 128:
+    ok = cfg.nodes > 1 ? run_nodes<128>(cfg, dist) : run<128>(cfg, dist);
+    break;
+  case 256:
+    ok = cfg.nodes > 1 ? run_nodes<256>(cfg, dist) : run<256>(cfg, dist);
+    break;
+  case 512:
+    ok = cfg.nodes > 1 ? run_nodes<512>(cfg, dist) : run<512>(cfg, dist);
+    break;
+  default:
+    usage();
+    return 2;
+  }
+  return ok ? 0 : 1;
+}